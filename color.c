@@ -0,0 +1,124 @@
+#include <stdint.h>
+
+#include "wiz.h"
+
+// The kernels in this file work on a color_buf, which stores per-device colors as separate channel arrays, COLOR_LANES devices at a time using GCC vector types. On x86-64, an AVX2 version and a baseline SSE2 version of each kernel are built and the best one is picked when the program starts. On other targets, the compiler lowers the vector types to whatever the target supports, down to plain scalar code.
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__)
+#define SIMD_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define SIMD_CLONES
+#endif
+
+typedef float vf __attribute__((vector_size(COLOR_LANES * sizeof(float))));
+typedef int32_t vi __attribute__((vector_size(COLOR_LANES * sizeof(int32_t))));
+typedef uint8_t vb __attribute__((vector_size(COLOR_LANES)));
+
+// unaligned views of the color_buf channels
+typedef float vf_u __attribute__((vector_size(COLOR_LANES * sizeof(float)), aligned(sizeof(float))));
+typedef uint8_t vb_u __attribute__((vector_size(COLOR_LANES), aligned(1)));
+
+// VSEL returns the lanes of a where mask is set and the lanes of b elsewhere.
+#define VSEL(mask, a, b) ((vf)(((vi)(a) & (mask)) | ((vi)(b) & ~(mask))))
+#define VMIN(a, b) VSEL((a) < (b), (a), (b))
+#define VMAX(a, b) VSEL((a) > (b), (a), (b))
+#define SPLAT(x) ((vf){} + (x))
+
+#define LOAD(p) (*(vf_u *)(p))
+#define STORE(p, v) (*(vf_u *)(p) = (v))
+// STORE_U8 clamps the lanes of v to [0, 255], rounds them, and stores them as bytes. Converting a float outside that range to uint8_t is undefined.
+#define STORE_U8(p, v)                                         \
+    do                                                         \
+    {                                                          \
+        vf v_ = VMAX(SPLAT(0), VMIN((v), SPLAT(255)));         \
+        *(vb_u *)(p) = __builtin_convertvector(v_ + 0.5f, vb); \
+    } while (0)
+
+static float minf(float a, float b) { return (a < b) ? a : b; }
+static float maxf(float a, float b) { return (a > b) ? a : b; }
+
+// padded returns n rounded up to a whole number of lanes. The color_buf arrays are MAX_DEVS long, which is a multiple of COLOR_LANES, so the padding is always in bounds.
+static int padded(int n) { return (n + COLOR_LANES - 1) & ~(COLOR_LANES - 1); }
+
+void rgb_to_hsv(color c, float *h, float *s, float *v)
+{
+    float r = c.r / 255.0f, g = c.g / 255.0f, b = c.b / 255.0f;
+    float hi = maxf(r, maxf(g, b));
+    float lo = minf(r, minf(g, b));
+    float d = hi - lo;
+
+    *v = hi;
+    *s = (hi > 0) ? d / hi : 0;
+    if (d == 0)
+        *h = 0;
+    else if (hi == r)
+        *h = (g - b) / d / 6;
+    else if (hi == g)
+        *h = ((b - r) / d + 2) / 6;
+    else
+        *h = ((r - g) / d + 4) / 6;
+    if (*h < 0)
+        *h += 1;
+}
+
+SIMD_CLONES
+void gradient_hsv(color_buf *buf, color from, color to, int n)
+{
+    float h0, s0, v0, h1, s1, v1;
+    rgb_to_hsv(from, &h0, &s0, &v0);
+    rgb_to_hsv(to, &h1, &s1, &v1);
+
+    // a gray endpoint has no hue of its own, so it borrows the other one's
+    if (s0 == 0)
+        h0 = h1;
+    if (s1 == 0)
+        h1 = h0;
+
+    // go around the hue circle the short way
+    float dh = h1 - h0;
+    if (dh > 0.5f)
+        dh -= 1;
+    else if (dh < -0.5f)
+        dh += 1;
+
+    float step = (n > 1) ? 1.0f / (n - 1) : 0;
+    vf lane = {};
+    for (int j = 0; j < COLOR_LANES; j++)
+        lane[j] = j;
+
+    buf->n = n;
+    for (int i = 0; i < padded(n); i += COLOR_LANES)
+    {
+        // the padding lanes past n would extrapolate beyond the end color
+        vf t = VMIN((lane + (float)i) * step, SPLAT(1));
+        vf h = h0 + dh * t;
+        h = VSEL(h < 0, h + 1, h);
+        h = VSEL(h >= 1, h - 1, h);
+        STORE(&buf->h[i], h);
+        STORE(&buf->s[i], s0 + (s1 - s0) * t);
+        STORE(&buf->v[i], v0 + (v1 - v0) * t);
+    }
+}
+
+SIMD_CLONES
+void hsv_to_rgb(color_buf *buf)
+{
+    // r, g, and b are each 1 - s * max(0, min(k, 4 - k, 1)), where k = (c + 6h) mod 6 and c is 5, 3, and 1 respectively
+    const float offsets[3] = {5, 3, 1};
+    uint8_t *out[3] = {buf->r, buf->g, buf->b};
+
+    for (int i = 0; i < padded(buf->n); i += COLOR_LANES)
+    {
+        vf h6 = LOAD(&buf->h[i]) * 6;
+        vf s = LOAD(&buf->s[i]);
+        for (int c = 0; c < 3; c++)
+        {
+            vf k = h6 + offsets[c];
+            k = VSEL(k >= 6, k - 6, k);
+            vf w = VMAX(SPLAT(0), VMIN(VMIN(k, 4 - k), SPLAT(1)));
+            STORE_U8(&out[c][i], (1 - s * w) * 255);
+        }
+
+        // the value channel is sent separately as the dimming level
+        STORE_U8(&buf->dimming[i], LOAD(&buf->v[i]) * 100);
+    }
+}
@@ -0,0 +1,354 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "wiz.h"
+
+// mktables writes tables.h, which holds minimal perfect hash tables for the scene and color names that wiz accepts, along with the json fragments that json_msg copies into requests.
+
+struct scene_def
+{
+    const char *name;
+    scene id;
+};
+
+static struct scene_def scenes[] = {
+    {"ocean", OCEAN},
+    {"romance", ROMANCE},
+    {"sunset", SUNSET},
+    {"party", PARTY},
+    {"fireplace", FIREPLACE},
+    {"cozy", COZY},
+    {"forest", FOREST},
+    {"pastel_colors", PASTEL_COLORS},
+    {"wake_up", WAKE_UP},
+    {"bedtime", BEDTIME},
+    {"warm_white", WARM_WHITE},
+    {"daylight", DAYLIGHT},
+    {"cool_white", COOL_WHITE},
+    {"night_light", NIGHT_LIGHT},
+    {"focus", FOCUS},
+    {"relax", RELAX},
+    {"true_colors", TRUE_COLORS},
+    {"tv_time", TV_TIME},
+    {"plant_growth", PLANT_GROWTH},
+    {"spring", SPRING},
+    {"summer", SUMMER},
+    {"fall", FALL},
+    {"deep_dive", DEEP_DIVE},
+    {"jungle", JUNGLE},
+    {"mojito", MOJITO},
+    {"club", CLUB},
+    {"christmas", CHRISTMAS},
+    {"halloween", HALLOWEEN},
+    {"candle_light", CANDLE_LIGHT},
+    {"golden_white", GOLDEN_WHITE},
+    {"pulse", PULSE},
+    {"steampunk", STEAMPUNK},
+    {"diwali", DIWALI},
+};
+
+struct color_def
+{
+    const char *name;
+    uint32_t rgb;
+};
+
+// The CSS/X11 named colors. r, g, and b are shorthands for red, green, and blue, and green keeps its original meaning of pure green (CSS lime) rather than the CSS value of 0x008000.
+static struct color_def colors[] = {
+    {"r", 0xff0000},
+    {"g", 0x00ff00},
+    {"b", 0x0000ff},
+    {"aliceblue", 0xf0f8ff},
+    {"antiquewhite", 0xfaebd7},
+    {"aqua", 0x00ffff},
+    {"aquamarine", 0x7fffd4},
+    {"azure", 0xf0ffff},
+    {"beige", 0xf5f5dc},
+    {"bisque", 0xffe4c4},
+    {"black", 0x000000},
+    {"blanchedalmond", 0xffebcd},
+    {"blue", 0x0000ff},
+    {"blueviolet", 0x8a2be2},
+    {"brown", 0xa52a2a},
+    {"burlywood", 0xdeb887},
+    {"cadetblue", 0x5f9ea0},
+    {"chartreuse", 0x7fff00},
+    {"chocolate", 0xd2691e},
+    {"coral", 0xff7f50},
+    {"cornflowerblue", 0x6495ed},
+    {"cornsilk", 0xfff8dc},
+    {"crimson", 0xdc143c},
+    {"cyan", 0x00ffff},
+    {"darkblue", 0x00008b},
+    {"darkcyan", 0x008b8b},
+    {"darkgoldenrod", 0xb8860b},
+    {"darkgray", 0xa9a9a9},
+    {"darkgreen", 0x006400},
+    {"darkgrey", 0xa9a9a9},
+    {"darkkhaki", 0xbdb76b},
+    {"darkmagenta", 0x8b008b},
+    {"darkolivegreen", 0x556b2f},
+    {"darkorange", 0xff8c00},
+    {"darkorchid", 0x9932cc},
+    {"darkred", 0x8b0000},
+    {"darksalmon", 0xe9967a},
+    {"darkseagreen", 0x8fbc8f},
+    {"darkslateblue", 0x483d8b},
+    {"darkslategray", 0x2f4f4f},
+    {"darkslategrey", 0x2f4f4f},
+    {"darkturquoise", 0x00ced1},
+    {"darkviolet", 0x9400d3},
+    {"deeppink", 0xff1493},
+    {"deepskyblue", 0x00bfff},
+    {"dimgray", 0x696969},
+    {"dimgrey", 0x696969},
+    {"dodgerblue", 0x1e90ff},
+    {"firebrick", 0xb22222},
+    {"floralwhite", 0xfffaf0},
+    {"forestgreen", 0x228b22},
+    {"fuchsia", 0xff00ff},
+    {"gainsboro", 0xdcdcdc},
+    {"ghostwhite", 0xf8f8ff},
+    {"gold", 0xffd700},
+    {"goldenrod", 0xdaa520},
+    {"gray", 0x808080},
+    {"green", 0x00ff00},
+    {"greenyellow", 0xadff2f},
+    {"grey", 0x808080},
+    {"honeydew", 0xf0fff0},
+    {"hotpink", 0xff69b4},
+    {"indianred", 0xcd5c5c},
+    {"indigo", 0x4b0082},
+    {"ivory", 0xfffff0},
+    {"khaki", 0xf0e68c},
+    {"lavender", 0xe6e6fa},
+    {"lavenderblush", 0xfff0f5},
+    {"lawngreen", 0x7cfc00},
+    {"lemonchiffon", 0xfffacd},
+    {"lightblue", 0xadd8e6},
+    {"lightcoral", 0xf08080},
+    {"lightcyan", 0xe0ffff},
+    {"lightgoldenrodyellow", 0xfafad2},
+    {"lightgray", 0xd3d3d3},
+    {"lightgreen", 0x90ee90},
+    {"lightgrey", 0xd3d3d3},
+    {"lightpink", 0xffb6c1},
+    {"lightsalmon", 0xffa07a},
+    {"lightseagreen", 0x20b2aa},
+    {"lightskyblue", 0x87cefa},
+    {"lightslategray", 0x778899},
+    {"lightslategrey", 0x778899},
+    {"lightsteelblue", 0xb0c4de},
+    {"lightyellow", 0xffffe0},
+    {"lime", 0x00ff00},
+    {"limegreen", 0x32cd32},
+    {"linen", 0xfaf0e6},
+    {"magenta", 0xff00ff},
+    {"maroon", 0x800000},
+    {"mediumaquamarine", 0x66cdaa},
+    {"mediumblue", 0x0000cd},
+    {"mediumorchid", 0xba55d3},
+    {"mediumpurple", 0x9370db},
+    {"mediumseagreen", 0x3cb371},
+    {"mediumslateblue", 0x7b68ee},
+    {"mediumspringgreen", 0x00fa9a},
+    {"mediumturquoise", 0x48d1cc},
+    {"mediumvioletred", 0xc71585},
+    {"midnightblue", 0x191970},
+    {"mintcream", 0xf5fffa},
+    {"mistyrose", 0xffe4e1},
+    {"moccasin", 0xffe4b5},
+    {"navajowhite", 0xffdead},
+    {"navy", 0x000080},
+    {"oldlace", 0xfdf5e6},
+    {"olive", 0x808000},
+    {"olivedrab", 0x6b8e23},
+    {"orange", 0xffa500},
+    {"orangered", 0xff4500},
+    {"orchid", 0xda70d6},
+    {"palegoldenrod", 0xeee8aa},
+    {"palegreen", 0x98fb98},
+    {"paleturquoise", 0xafeeee},
+    {"palevioletred", 0xdb7093},
+    {"papayawhip", 0xffefd5},
+    {"peachpuff", 0xffdab9},
+    {"peru", 0xcd853f},
+    {"pink", 0xffc0cb},
+    {"plum", 0xdda0dd},
+    {"powderblue", 0xb0e0e6},
+    {"purple", 0x800080},
+    {"rebeccapurple", 0x663399},
+    {"red", 0xff0000},
+    {"rosybrown", 0xbc8f8f},
+    {"royalblue", 0x4169e1},
+    {"saddlebrown", 0x8b4513},
+    {"salmon", 0xfa8072},
+    {"sandybrown", 0xf4a460},
+    {"seagreen", 0x2e8b57},
+    {"seashell", 0xfff5ee},
+    {"sienna", 0xa0522d},
+    {"silver", 0xc0c0c0},
+    {"skyblue", 0x87ceeb},
+    {"slateblue", 0x6a5acd},
+    {"slategray", 0x708090},
+    {"slategrey", 0x708090},
+    {"snow", 0xfffafa},
+    {"springgreen", 0x00ff7f},
+    {"steelblue", 0x4682b4},
+    {"tan", 0xd2b48c},
+    {"teal", 0x008080},
+    {"thistle", 0xd8bfd8},
+    {"tomato", 0xff6347},
+    {"turquoise", 0x40e0d0},
+    {"violet", 0xee82ee},
+    {"wheat", 0xf5deb3},
+    {"white", 0xffffff},
+    {"whitesmoke", 0xf5f5f5},
+    {"yellow", 0xffff00},
+    {"yellowgreen", 0x9acd32},
+};
+
+#define LEN(a) (int)(sizeof(a) / sizeof(a[0]))
+#define MAX_KEYS 256
+
+// bucket_sizes is read by cmp_bucket_size to sort buckets from largest to smallest.
+static int *bucket_sizes;
+
+static int cmp_bucket_size(const void *a, const void *b)
+{
+    return bucket_sizes[*(const int *)b] - bucket_sizes[*(const int *)a];
+}
+
+/*
+  build_phf builds a minimal perfect hash over the n names using hash and displace: each name falls into bucket name_hash(0, name) % n, and each bucket is assigned the smallest displacement d such that name_hash(d, name) % n sends all of its names to free slots. Larger buckets are placed first. On return, disp holds the displacement of each bucket and slot holds the final position of each name.
+ */
+static void build_phf(const char *names[], int n, uint16_t disp[], int slot[])
+{
+    int bucket[MAX_KEYS], sizes[MAX_KEYS] = {}, order[MAX_KEYS];
+    char taken[MAX_KEYS] = {};
+
+    for (int i = 0; i < n; i++)
+    {
+        bucket[i] = name_hash(0, names[i]) % n;
+        sizes[bucket[i]]++;
+    }
+    for (int b = 0; b < n; b++)
+        order[b] = b;
+    bucket_sizes = sizes;
+    qsort(order, n, sizeof(int), cmp_bucket_size);
+
+    for (int o = 0; o < n; o++)
+    {
+        int b = order[o];
+        disp[b] = 0;
+        if (sizes[b] == 0)
+            continue;
+
+        for (uint32_t d = 1;; d++)
+        {
+            if (d > UINT16_MAX)
+            {
+                fprintf(stderr, "mktables: unable to place bucket %d\n", b);
+                exit(EXIT_FAILURE);
+            }
+            int placed[MAX_KEYS], np = 0;
+            bool ok = true;
+            for (int i = 0; i < n && ok; i++)
+            {
+                if (bucket[i] != b)
+                    continue;
+                int s = name_hash(d, names[i]) % n;
+                if (taken[s])
+                    ok = false;
+                for (int j = 0; j < np && ok; j++)
+                {
+                    if (slot[placed[j]] == s)
+                        ok = false;
+                }
+                slot[i] = s;
+                placed[np++] = i;
+            }
+            if (!ok)
+                continue;
+
+            for (int j = 0; j < np; j++)
+                taken[slot[placed[j]]] = 1;
+            disp[b] = d;
+            break;
+        }
+    }
+}
+
+static void print_disp(const char *table, uint16_t disp[], int n)
+{
+    printf("static const uint16_t %s_disp[%d] = {", table, n);
+    for (int i = 0; i < n; i++)
+        printf("%s%u", (i == 0) ? "\n    " : (i % 16) ? ", " : ",\n    ", disp[i]);
+    printf(",\n};\n\n");
+}
+
+int main(void)
+{
+    const char *names[MAX_KEYS];
+    uint16_t disp[MAX_KEYS];
+    int slot[MAX_KEYS], inv[MAX_KEYS];
+
+    printf("// Generated by mktables. Do not edit.\n\n");
+
+    // scenes
+    int n = LEN(scenes);
+    for (int i = 0; i < n; i++)
+        names[i] = scenes[i].name;
+    build_phf(names, n, disp, slot);
+    for (int i = 0; i < n; i++)
+        inv[slot[i]] = i;
+
+    printf("#define SCENE_TABLE_LEN %d\n\n", n);
+    print_disp("scene", disp, n);
+    printf("static const char *const scene_names[%d] = {\n", n);
+    for (int i = 0; i < n; i++)
+        printf("    \"%s\",\n", scenes[inv[i]].name);
+    printf("};\n\n");
+    printf("static const scene scene_ids[%d] = {\n", n);
+    for (int i = 0; i < n; i++)
+        printf("    %d,\n", scenes[inv[i]].id);
+    printf("};\n\n");
+    // the scene fragments are indexed by scene id rather than by hash slot
+    printf("static const char *const scene_json[MAX_SCENE] = {\n    \"\",\n");
+    for (int id = 1; id < MAX_SCENE; id++)
+        printf("    \"\\\"sceneId\\\":%d,\",\n", id);
+    printf("};\n\n");
+
+    // colors
+    n = LEN(colors);
+    for (int i = 0; i < n; i++)
+        names[i] = colors[i].name;
+    build_phf(names, n, disp, slot);
+    for (int i = 0; i < n; i++)
+        inv[slot[i]] = i;
+
+    printf("#define COLOR_TABLE_LEN %d\n\n", n);
+    print_disp("color", disp, n);
+    printf("static const char *const color_names[%d] = {\n", n);
+    for (int i = 0; i < n; i++)
+        printf("    \"%s\",\n", colors[inv[i]].name);
+    printf("};\n\n");
+    printf("static const color color_vals[%d] = {\n", n);
+    for (int i = 0; i < n; i++)
+    {
+        uint32_t rgb = colors[inv[i]].rgb;
+        printf("    {%u, %u, %u},\n", rgb >> 16, (rgb >> 8) & 0xff, rgb & 0xff);
+    }
+    printf("};\n\n");
+    printf("static const char *const color_json[%d] = {\n", n);
+    for (int i = 0; i < n; i++)
+    {
+        uint32_t rgb = colors[inv[i]].rgb;
+        printf("    \"\\\"r\\\":%u,\\\"g\\\":%u,\\\"b\\\":%u,\",\n", rgb >> 16, (rgb >> 8) & 0xff, rgb & 0xff);
+    }
+    printf("};\n");
+
+    return EXIT_SUCCESS;
+}
@@ -9,3 +9,5 @@ else
 fi
 rm ${DATA_PATH}
 sudo rm /usr/local/bin/wiz
+sudo rm -f /usr/local/bin/wiztrace
+sudo rm -f /usr/local/bin/wizreplay
@@ -1,29 +1,51 @@
+#define _GNU_SOURCE
 #include <argp.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <linux/errqueue.h>
 #include <linux/limits.h>
+#include <linux/neighbour.h>
+#include <linux/net_tstamp.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 #include <netinet/in.h>
 #include <netinet/udp.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "wiz.h"
+#include "tables.h"
 
 const char *argp_program_version = "wiz_cli v0.0.1";
 const char *argp_program_bug_address = "<info@finfaq.net>";
 const char doc[] = "wiz is a cli tool for controlling wiz lights.";
 
+#define OPT_STATS 0x100
+#define OPT_TRACE 0x101
+#define OPT_GRADIENT 0x102
+#define OPT_STDIN 0x103
+#define OPT_CAPTURE 0x104
+
 static struct argp_option options[] = {
+    {"adaptive", 'a', 0, 0, "Wait for replies and resend to each device based on its delivery history (ignores --repeat; config file devices only)", 0},
     {"broadcast", 'b', 0, 0, "Broadcasts the command to all devices on the current network, regardless of whether they appear in the config file", 0},
-    {"color", 'c', "COLOR", 0, "Color name (r, g, b, red, green, or blue) or RGB (0-255,0-255,0-255) color value", 0},
+    {"color", 'c', "COLOR", 0, "CSS color name (e.g. red, green, coral, or r, g, b) or RGB (0-255,0-255,0-255) color value", 0},
+    {"gradient", OPT_GRADIENT, "FROM:TO", 0, "Spread a gradient between two colors (names or RGB values) across the selected devices, in the order they are listed; sets each device's dimming unless --dimming is given", 0},
     {"dimming", 'u', "PERCENT", 0, "Dimming/brightness level percentage (0-100, lower is dimmer)", 0},
+    {"engine", 'e', "ENGINE", 0, "Send engine: batch (default; one sendmmsg call per round of packets) or plain (one sendto call per packet)", 0},
     {"discover", 'd', "TIMEOUT,MAX_DEVS", 0, "Broadcast a discovery signal to the network and print responses to stdout until TIMEOUT (in seconds) elapses or MAX_DEVS responses have been received", 0},
     {"ips", 'i', "ADDRESS", 0, "Comma-separated list of device IP addresses", 0},
     {"kelvin", 'k', "KELVIN", 0, "Temperature in kelvins, must be in [2000, 9000)", 0},
@@ -35,6 +57,10 @@ static struct argp_option options[] = {
     {"room", 'r', "[ROOM...]", 0, "Name of the room or comma-separated list of rooms", 0},
     {"scene", 's', "SCENE", 0, "Name of the scene", 0},
     {"speed", 'v', "SPEED", 0, "Scene transition speed (10-200)", 0},
+    {"trace", OPT_TRACE, "FILE", 0, "Write kernel send and receive timestamps for each request and reply to FILE (implies --adaptive); summarize it with wiztrace", 0},
+    {"stdin", OPT_STDIN, 0, 0, "Keep running and read commands from stdin, one per line, using the same options as the command line; the config file is reloaded whenever it changes", 0},
+    {"capture", OPT_CAPTURE, "FILE", 0, "Record every packet sent and received, with timestamps, to FILE; play it back with wizreplay", 0},
+    {"stats", OPT_STATS, "FORMAT", OPTION_ARG_OPTIONAL, "Print phase timings, syscall counts, and device packet and byte counts to stderr as a table (default) or json; buffered trace and capture writes count once per flush", 0},
     {0}, // "This should be terminated by an entry with zero in all fields."
 };
 
@@ -48,9 +74,92 @@ static int clamp(int min, int max, int n)
     return (n < max) ? n : max;
 }
 
+static int64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// rstats collects the --stats report. The I/O counters are always updated; phase timings are only taken when the report is enabled.
+static struct run_stats rstats;
+
+// trace_fp receives the --trace records written by send_cmds_adaptive, or is NULL when tracing is off.
+static FILE *trace_fp;
+
+// capture_fp receives the --capture records of every packet sent or received, or is NULL when capturing is off.
+static FILE *capture_fp;
+
+// batch_send selects the send engine. When it is false, or when sendmmsg is unavailable, send_batch falls back to one sendto call per packet.
+static bool batch_send = true;
+
+// capture_pkt records a packet of len bytes sent to (CAPTURE_TX) or received from (CAPTURE_RX) addr.
+static void capture_pkt(uint8_t dir, struct sockaddr_in *addr, void *data, uint32_t len)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    struct capture_rec rec = {};
+    rec.ns = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    rec.addr = addr->sin_addr.s_addr;
+    rec.port = addr->sin_port;
+    rec.dir = dir;
+    rec.len = len;
+    fwrite(&rec, sizeof(rec), 1, capture_fp);
+    fwrite(data, len, 1, capture_fp);
+}
+
+static const char *phase_strs[] = {"load", "parse", "encode", "send", "discover"};
+
+static int64_t phase_start(void) { return rstats.enabled ? now_us() : 0; }
+
+static void phase_end(phase p, int64_t t)
+{
+    if (rstats.enabled)
+        rstats.phase_us[p] += now_us() - t;
+}
+
+// count_sys records one system call. It is called next to each call it counts so that early returns are not missed. Writes that stdio buffers, to the --trace and --capture files and the rewritten config file, are counted once when the file is flushed or closed rather than per fwrite.
+static void count_sys(void) { rstats.syscalls++; }
+
+// count_tx and count_rx record UDP datagrams exchanged with devices. Netlink and file traffic is not counted.
+static void count_tx(int packets, long bytes)
+{
+    rstats.tx_packets += packets;
+    rstats.tx_bytes += bytes;
+}
+
+static void count_rx(int packets, long bytes)
+{
+    rstats.rx_packets += packets;
+    rstats.rx_bytes += bytes;
+}
+
+// print_run_stats writes the --stats report to stderr. It is registered with atexit.
+static void print_run_stats(void)
+{
+    int64_t total = now_us() - rstats.start;
+    if (rstats.json)
+    {
+        fprintf(stderr, "{\"total_us\":%ld", (long)total);
+        for (int i = 0; i < MAX_PHASE; i++)
+            fprintf(stderr, ",\"%s_us\":%ld", phase_strs[i], (long)rstats.phase_us[i]);
+        fprintf(stderr, ",\"syscalls\":%d,\"tx_packets\":%d,\"tx_bytes\":%ld,\"rx_packets\":%d,\"rx_bytes\":%ld}\n",
+                rstats.syscalls, rstats.tx_packets, rstats.tx_bytes, rstats.rx_packets, rstats.rx_bytes);
+        return;
+    }
+    fprintf(stderr, "PHASE\tTIME (us)\n");
+    for (int i = 0; i < MAX_PHASE; i++)
+        fprintf(stderr, "%s\t%ld\n", phase_strs[i], (long)rstats.phase_us[i]);
+    fprintf(stderr, "total\t%ld\n\n", (long)total);
+    fprintf(stderr, "syscalls\t%d\n", rstats.syscalls);
+    fprintf(stderr, "tx packets\t%d\ntx bytes\t%ld\n", rstats.tx_packets, rstats.tx_bytes);
+    fprintf(stderr, "rx packets\t%d\nrx bytes\t%ld\n", rstats.rx_packets, rstats.rx_bytes);
+}
+
 int main(int argc, char *argv[])
 {
     int exit_status = EXIT_SUCCESS;
+    rstats.start = now_us();
     // parse arguments
     struct arg_vals args = {};
     error_t err = argp_parse(&argp, argc, argv, 0, 0, &args);
@@ -59,199 +168,1527 @@ int main(int argc, char *argv[])
         perror(NULL);
         return EXIT_FAILURE;
     }
+    rstats.enabled = args.stats;
+    rstats.json = args.stats_json;
+    if (rstats.enabled)
+        atexit(print_run_stats);
+
+    if (check_args(args) < 0)
+        return EXIT_FAILURE;
+
+    if (args.capture != NULL)
+    {
+        count_sys();
+        capture_fp = fopen(args.capture, "w");
+        if (capture_fp == NULL)
+        {
+            fprintf(stderr, "unable to open capture file\n");
+            perror(NULL);
+            return EXIT_FAILURE;
+        }
+        struct capture_hdr hdr = {CAPTURE_MAGIC, CAPTURE_VERSION};
+        fwrite(&hdr, sizeof(hdr), 1, capture_fp);
+    }
 
     // check if the program is operating in discovery mode, broadcast mode, or ip mode.
     // these modes do not read the device config file.
+    if (args.discover || args.broadcast || args.ips != NULL)
+    {
+        exit_status = run_configless(args);
+        goto done;
+    }
+
+    char wiz_path[PATH_MAX];
+    char *wiz_path_tmp;
+    // first check if WIZ_PATH is defined...
+    wiz_path_tmp = getenv("WIZ_PATH");
+    if (wiz_path_tmp == NULL) {
+        // then look to see if the XDG_DATA_HOME dir is something other than expected
+        wiz_path_tmp = getenv("XDG_DATA_HOME");
+        if (wiz_path_tmp == NULL) {
+            // finally, go with the default
+            wiz_path_tmp = getenv("HOME");
+            if (wiz_path_tmp == NULL) {
+                fprintf(stderr, "unable to determine user's home directory\n");
+                exit_status = EXIT_FAILURE;
+                goto done;
+            }
+            sprintf(wiz_path, "%s/.local/share/wiz.csv", wiz_path_tmp);
+        } else {
+            sprintf(wiz_path, "%s/wiz.csv", wiz_path_tmp);
+        }
+    } else {
+        strncpy(wiz_path, wiz_path_tmp, PATH_MAX);
+    }
+
+    // resolve symlinks once, so that --stdin watches the same file that write_config_ips replaces.
+    // a config file that does not exist yet is left as is for read_config to create.
+    char real_path[PATH_MAX];
+    if (realpath(wiz_path, real_path) != NULL)
+        strcpy(wiz_path, real_path);
+
+    if (args.read_stdin)
+    {
+        exit_status = serve_stdin(wiz_path);
+        goto done;
+    }
+
+    // load the device configs into memory
+    int64_t t = phase_start();
+    long size;
+    char *buf = read_config(wiz_path, &size, true);
+    phase_end(PHASE_LOAD, t);
+    if (buf == NULL)
+    {
+        exit_status = EXIT_FAILURE;
+        goto done;
+    }
+
+    // parse devices names/ips from the config file
+    t = phase_start();
+    device devs[MAX_DEVS];
+    int n = 0;
+    n = parse_csv(buf, size + 1, devs, args.name, args.room);
+    phase_end(PHASE_PARSE, t);
+    if (n < 0)
+    {
+        perror(NULL);
+        exit_status = EXIT_FAILURE;
+        goto end;
+    }
+    if (n == 0)
+    {
+        fprintf(stderr, "no devices read from the configuration file\n");
+        exit_status = EXIT_FAILURE;
+        goto end;
+    }
+
+    exit_status = send_to_devs(args, devs, n, wiz_path);
+
+end:
+    free(buf);
+
+done:
+    // fwrite errors are sticky, so a capture cut short by a full disk is reported here
+    if (capture_fp != NULL)
+    {
+        bool failed = ferror(capture_fp);
+        count_sys();
+        if (fclose(capture_fp) != 0 || failed)
+        {
+            fprintf(stderr, "unable to write capture file\n");
+            exit_status = EXIT_FAILURE;
+        }
+    }
+    return exit_status;
+}
 
+int check_args(struct arg_vals args)
+{
+    if (args.gradient && (args.broadcast || args.discover || args.adaptive))
+    {
+        fprintf(stderr, "--gradient cannot be combined with --broadcast, --discover, --adaptive, or --trace\n");
+        return -1;
+    }
+    return 0;
+}
+
+int run_configless(struct arg_vals args)
+{
+    int exit_status = EXIT_SUCCESS;
     if (args.discover)
     {
+        int64_t t = phase_start();
         for (int i = 0; i <= args.repeat; i++)
         {
             exit_status = broadcast_udp_wait(INFO, sizeof(INFO), args.seconds, args.num_devs);
         }
-        return exit_status;
+        phase_end(PHASE_DISCOVER, t);
+        return exit_status;
+    }
+
+    if (args.broadcast)
+    {
+        for (int i = 0; i <= args.repeat; i++)
+        {
+            exit_status = msg_all(args);
+        }
+        return exit_status;
+    }
+
+    for (int i = 0; i <= args.repeat; i++)
+    {
+        exit_status = use_ips(args);
+    }
+    return exit_status;
+}
+
+char *read_config(char *path, long *size, bool create)
+{
+    struct stat fstat;
+    count_sys();
+    if ((stat(path, &fstat)) < 0)
+    {
+        fprintf(stderr, "unable to stat device configuration file\n");
+        perror(NULL);
+        // attempt to create this file if possible
+        if (create)
+        {
+            count_sys();
+            FILE *tmp_fp = fopen(path, "w");
+            if (tmp_fp != NULL)
+            {
+                count_sys();
+                fclose(tmp_fp);
+            }
+        }
+
+        return NULL;
+    }
+    if (fstat.st_size == 0)
+    {
+        fprintf(stderr, "device configuration file is empty\n");
+        return NULL;
+    }
+    char *buf = malloc(fstat.st_size + 1);
+    if (buf == NULL)
+    {
+        perror(NULL);
+        return NULL;
+    }
+    buf[fstat.st_size] = '\0';
+
+    count_sys();
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "unable to open device configuration file\n");
+        perror(NULL);
+        free(buf);
+        return NULL;
+    }
+    count_sys();
+    if (fread(buf, fstat.st_size, 1, fp) == 0)
+    {
+        fprintf(stderr, "unable to read device configuration file\n");
+        count_sys();
+        fclose(fp);
+        free(buf);
+        return NULL;
+    }
+    count_sys();
+    if (fclose(fp) < 0)
+    {
+        fprintf(stderr, "unable to close device configuration file\n");
+        perror(NULL);
+        free(buf);
+        return NULL;
+    }
+    *size = fstat.st_size;
+    return buf;
+}
+
+int send_to_devs(struct arg_vals args, device devs[], int n, char *wiz_path)
+{
+    int exit_status = EXIT_SUCCESS;
+    int64_t t = phase_start();
+    char msg[MAX_REQ];
+    static char msgs[MAX_DEVS][MAX_REQ];
+    int mlens[MAX_DEVS];
+    int mlen;
+    if (args.gradient)
+    {
+        mlen = gradient_msgs(msgs, mlens, args, n);
+        strcpy(msg, msgs[0]);
+    }
+    else
+        mlen = json_msg(msg, args);
+    phase_end(PHASE_ENCODE, t);
+    if (mlen < 0) {
+        fprintf(stderr, "error writing json message: %s\n", msg);
+        return exit_status;
+    }
+
+    if (args.list)
+    {
+        printf("Devices\n");
+        printf("NAME\tIP ADDRESS\tROOM\n");
+        for (int i = 0; i < n; i++)
+        {
+            printf("%s\t%s", devs[i].name, devs[i].ip);
+            if (devs[i].room == NULL)
+                printf("\n");
+            else
+                printf("\t%s\n", devs[i].room);
+        }
+    }
+
+    t = phase_start();
+    if (args.adaptive)
+    {
+        char stats_path[PATH_MAX + 8];
+        snprintf(stats_path, sizeof(stats_path), "%s.stats", wiz_path);
+        dev_stats *stats = open_stats(stats_path);
+        if (stats == NULL)
+        {
+            fprintf(stderr, "unable to open delivery stats file\n");
+            perror(NULL);
+            return EXIT_FAILURE;
+        }
+        if (args.trace != NULL)
+        {
+            count_sys();
+            trace_fp = fopen(args.trace, "w");
+            if (trace_fp == NULL)
+            {
+                fprintf(stderr, "unable to open trace file\n");
+                perror(NULL);
+                close_stats(stats);
+                return EXIT_FAILURE;
+            }
+            struct trace_hdr hdr = {TRACE_MAGIC, TRACE_VERSION};
+            fwrite(&hdr, sizeof(hdr), 1, trace_fp);
+        }
+        bool missed[MAX_DEVS];
+        int res = send_cmds_adaptive(msg, mlen, devs, n, stats, missed);
+        if (res > 0)
+            res = retry_resolved(msg, mlen, devs, n, missed, stats, wiz_path);
+        if (res != 0)
+            exit_status = EXIT_FAILURE;
+        close_stats(stats);
+        if (trace_fp != NULL)
+        {
+            count_sys();
+            if (fclose(trace_fp) != 0)
+            {
+                fprintf(stderr, "unable to write trace file\n");
+                exit_status = EXIT_FAILURE;
+            }
+        }
+        trace_fp = NULL;
+        phase_end(PHASE_SEND, t);
+        return exit_status;
+    }
+
+    for (int i = 0; i <= args.repeat; i++)
+    {
+        int sent = (args.gradient) ? send_cmds_each(msgs, mlens, devs, n) : send_cmds(msg, mlen, devs, n);
+        if (sent < 0)
+        {
+            fprintf(stderr, "error sending cmds\n");
+            exit_status = EXIT_FAILURE;
+        }
+    }
+    phase_end(PHASE_SEND, t);
+    return exit_status;
+}
+
+dev_table *load_table(char *path)
+{
+    dev_table *tbl = malloc(sizeof(dev_table));
+    if (tbl == NULL)
+    {
+        perror(NULL);
+        return NULL;
+    }
+    long size;
+    // the file may be reloaded while another program is writing it, so it must never be created or truncated here
+    tbl->buf = read_config(path, &size, false);
+    if (tbl->buf == NULL)
+    {
+        free(tbl);
+        return NULL;
+    }
+    tbl->n = parse_csv(tbl->buf, size + 1, tbl->devs, NULL, NULL);
+    if (tbl->n < 0)
+    {
+        free_table(tbl);
+        return NULL;
+    }
+    return tbl;
+}
+
+void free_table(dev_table *tbl)
+{
+    if (tbl == NULL)
+        return;
+    free(tbl->buf);
+    free(tbl);
+}
+
+// find_dev returns the device in tbl with the given name, or NULL.
+static device *find_dev(dev_table *tbl, char *name)
+{
+    for (int i = 0; i < tbl->n; i++)
+    {
+        if (strcmp(tbl->devs[i].name, name) == 0)
+            return &tbl->devs[i];
+    }
+    return NULL;
+}
+
+int diff_tables(dev_table *old, dev_table *new)
+{
+    int changes = 0;
+    for (int i = 0; i < new->n; i++)
+    {
+        device *d = &new->devs[i];
+        device *prev = find_dev(old, d->name);
+        if (prev == NULL)
+        {
+            fprintf(stderr, "added %s (%s)\n", d->name, d->ip);
+            changes++;
+        }
+        else if (strcmp(prev->ip, d->ip) != 0)
+        {
+            fprintf(stderr, "moved %s (%s -> %s)\n", d->name, prev->ip, d->ip);
+            changes++;
+        }
+        else if ((prev->room == NULL) != (d->room == NULL) || (d->room != NULL && strcmp(prev->room, d->room) != 0))
+        {
+            fprintf(stderr, "moved %s to room %s\n", d->name, (d->room == NULL) ? "(none)" : d->room);
+            changes++;
+        }
+        else if ((prev->mac == NULL) != (d->mac == NULL) || (d->mac != NULL && strcmp(prev->mac, d->mac) != 0))
+        {
+            fprintf(stderr, "changed mac address of %s to %s\n", d->name, (d->mac == NULL) ? "(none)" : d->mac);
+            changes++;
+        }
+    }
+    for (int i = 0; i < old->n; i++)
+    {
+        if (find_dev(new, old->devs[i].name) == NULL)
+        {
+            fprintf(stderr, "removed %s (%s)\n", old->devs[i].name, old->devs[i].ip);
+            changes++;
+        }
+    }
+    return changes;
+}
+
+int select_devs(dev_table *tbl, char *names, char *rooms, device devs[])
+{
+    int n = 0;
+    for (int i = 0; i < tbl->n; i++)
+    {
+        device *d = &tbl->devs[i];
+        if (names != NULL && !is_in(d->name, names))
+            continue;
+        if (rooms != NULL && (d->room == NULL || !is_in(d->room, rooms)))
+            continue;
+        devs[n++] = *d;
+    }
+    return n;
+}
+
+// run_line parses line as a set of command line options and carries out the command against the devices in tbl. Options that set process-wide state start over from the session's values on each line: batch is the send engine given on the command line.
+static int run_line(char *line, dev_table *tbl, char *wiz_path, bool batch)
+{
+    char *argv[64] = {"wiz"};
+    int argc = 1;
+    char *tok = strtok(line, " \t\r");
+    for (; tok != NULL && argc < 63; tok = strtok(NULL, " \t\r"))
+        argv[argc++] = tok;
+    if (tok != NULL)
+    {
+        fprintf(stderr, "too many options in command\n");
+        return EXIT_FAILURE;
+    }
+    if (argc == 1)
+        return EXIT_SUCCESS;
+
+    batch_send = batch;
+    struct arg_vals args = {};
+    if (argp_parse(&argp, argc, argv, ARGP_NO_EXIT, 0, &args) != 0)
+        return EXIT_FAILURE;
+    if (args.stats || args.capture != NULL || args.read_stdin)
+    {
+        fprintf(stderr, "--stats, --capture, and --stdin apply to the whole session and must be given on the command line\n");
+        return EXIT_FAILURE;
+    }
+    if (check_args(args) < 0)
+        return EXIT_FAILURE;
+    if (args.discover || args.broadcast || args.ips != NULL)
+        return run_configless(args);
+
+    device devs[MAX_DEVS];
+    int n = select_devs(tbl, args.name, args.room, devs);
+    if (n == 0)
+    {
+        fprintf(stderr, "no matching devices in the configuration file\n");
+        return EXIT_FAILURE;
+    }
+    return send_to_devs(args, devs, n, wiz_path);
+}
+
+// config_changed drains the pending inotify events on fd and reports whether any of them concern the file named base.
+static bool config_changed(int fd, char *base)
+{
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool changed = false;
+    ssize_t len;
+    for (;;)
+    {
+        count_sys();
+        if ((len = read(fd, events, sizeof(events))) <= 0)
+            break;
+        for (char *p = events; p < events + len;)
+        {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            if (ev->len > 0 && strcmp(ev->name, base) == 0)
+                changed = true;
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+    return changed;
+}
+
+int serve_stdin(char *wiz_path)
+{
+    dev_table *tbl = load_table(wiz_path);
+    if (tbl == NULL)
+        return EXIT_FAILURE;
+
+    // watch the directory rather than the file, since editors often replace the file instead of writing to it
+    char dir[PATH_MAX];
+    strncpy(dir, wiz_path, PATH_MAX - 1);
+    dir[PATH_MAX - 1] = '\0';
+    char *slash = strrchr(dir, '/');
+    char *base = (slash == NULL) ? wiz_path : &wiz_path[slash - dir + 1];
+    if (slash == NULL)
+        strcpy(dir, ".");
+    else if (slash == dir)
+        dir[1] = '\0';
+    else
+        *slash = '\0';
+
+    count_sys();
+    int ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    int wd = -1;
+    if (ifd >= 0)
+    {
+        // a file is only reloaded once its writer has closed it or it has been renamed into place; IN_CREATE would fire before anything is written
+        count_sys();
+        wd = inotify_add_watch(ifd, dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+    }
+    if (wd < 0)
+    {
+        fprintf(stderr, "unable to watch device configuration file\n");
+        perror(NULL);
+        if (ifd >= 0)
+        {
+            count_sys();
+            close(ifd);
+        }
+        free_table(tbl);
+        return EXIT_FAILURE;
+    }
+
+    int exit_status = EXIT_SUCCESS;
+    bool batch = batch_send;
+    char line[4096];
+    int len = 0;
+    // set after a command overflows line, until the newline that ends it has been skipped
+    bool skipping = false;
+    struct pollfd pfds[2] = {{STDIN_FILENO, POLLIN, 0}, {ifd, POLLIN, 0}};
+    for (;;)
+    {
+        count_sys();
+        if (poll(pfds, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror(NULL);
+            exit_status = EXIT_FAILURE;
+            break;
+        }
+
+        if ((pfds[1].revents & POLLIN) && config_changed(ifd, base))
+        {
+            // build the new table completely before swapping it in, so a command never sees a partly loaded table.
+            // commands run to completion between polls, so the old table has no readers once the swap is done.
+            // the new table is swapped in even if diff_tables reports nothing, since a change in row order matters to --gradient.
+            dev_table *next = load_table(wiz_path);
+            if (next != NULL)
+            {
+                diff_tables(tbl, next);
+                dev_table *old = tbl;
+                tbl = next;
+                free_table(old);
+            }
+        }
+
+        if (pfds[0].revents & (POLLIN | POLLHUP))
+        {
+            count_sys();
+            ssize_t got = read(STDIN_FILENO, &line[len], sizeof(line) - 1 - len);
+            if (got <= 0)
+            {
+                // the last command need not end with a newline
+                if (got == 0 && len > 0 && !skipping)
+                {
+                    line[len] = '\0';
+                    if (run_line(line, tbl, wiz_path, batch) != EXIT_SUCCESS)
+                        exit_status = EXIT_FAILURE;
+                    fflush(stdout);
+                }
+                break;
+            }
+            len += got;
+
+            char *start = line;
+            char *nl;
+            while ((nl = memchr(start, '\n', &line[len] - start)) != NULL)
+            {
+                *nl = '\0';
+                if (skipping)
+                {
+                    skipping = false;
+                    start = nl + 1;
+                    continue;
+                }
+                if (run_line(start, tbl, wiz_path, batch) != EXIT_SUCCESS)
+                    exit_status = EXIT_FAILURE;
+                fflush(stdout);
+                // the session may be ended by a signal, so keep the capture current
+                if (capture_fp != NULL)
+                {
+                    count_sys();
+                    fflush(capture_fp);
+                }
+                start = nl + 1;
+            }
+            len = &line[len] - start;
+            memmove(line, start, len);
+            if (len == sizeof(line) - 1)
+            {
+                // the rest of the command must not be run as a command of its own
+                if (!skipping)
+                {
+                    fprintf(stderr, "command too long\n");
+                    exit_status = EXIT_FAILURE;
+                }
+                skipping = true;
+                len = 0;
+            }
+        }
+    }
+
+    count_sys();
+    close(ifd);
+    free_table(tbl);
+    return exit_status;
+}
+
+static int send_iov(struct iovec iov[], device devs[], int num_devs);
+
+// send_batch writes the payload in iov[i] to the address in dst[i] on sockfd, for each of the n destinations. It returns 0 on success or -1 on failure.
+static int send_batch(int sockfd, struct iovec iov[], struct sockaddr_in dst[], int n)
+{
+    int i = 0;
+    if (batch_send)
+    {
+        struct mmsghdr hdrs[MAX_DEVS] = {};
+        for (int j = 0; j < n; j++)
+        {
+            hdrs[j].msg_hdr.msg_name = &dst[j];
+            hdrs[j].msg_hdr.msg_namelen = sizeof(dst[j]);
+            hdrs[j].msg_hdr.msg_iov = &iov[j];
+            hdrs[j].msg_hdr.msg_iovlen = 1;
+        }
+        // sendmmsg may stop early, so keep going from the first unsent message
+        while (i < n)
+        {
+            count_sys();
+            int sent = sendmmsg(sockfd, &hdrs[i], n - i, 0);
+            for (int j = i; j < i + sent; j++)
+            {
+                count_tx(1, iov[j].iov_len);
+                if (capture_fp != NULL)
+                    capture_pkt(CAPTURE_TX, &dst[j], iov[j].iov_base, iov[j].iov_len);
+            }
+            if (sent < 0)
+            {
+                if (errno == ENOSYS)
+                {
+                    batch_send = false;
+                    break;
+                }
+                perror(NULL);
+                return -1;
+            }
+            i += sent;
+        }
+    }
+
+    for (; i < n; i++)
+    {
+        count_sys();
+        if (sendto(sockfd, iov[i].iov_base, iov[i].iov_len, 0, (struct sockaddr *)(&dst[i]), sizeof(dst[i])) < 0)
+        {
+            perror(NULL);
+            return -1;
+        }
+        count_tx(1, iov[i].iov_len);
+        if (capture_fp != NULL)
+            capture_pkt(CAPTURE_TX, &dst[i], iov[i].iov_base, iov[i].iov_len);
+    }
+    return 0;
+}
+
+int send_cmds(char *msg, int mlen, device devs[], int num_devs)
+{
+    struct iovec iov[MAX_DEVS];
+    for (int i = 0; i < num_devs; i++)
+    {
+        iov[i].iov_base = msg;
+        iov[i].iov_len = mlen;
+    }
+    return send_iov(iov, devs, num_devs);
+}
+
+int send_cmds_each(char msgs[][MAX_REQ], int mlens[], device devs[], int num_devs)
+{
+    struct iovec iov[MAX_DEVS];
+    for (int i = 0; i < num_devs; i++)
+    {
+        iov[i].iov_base = msgs[i];
+        iov[i].iov_len = mlens[i];
+    }
+    return send_iov(iov, devs, num_devs);
+}
+
+// send_iov opens a UDP socket and writes the payload in iov[i] to devs[i].
+static int send_iov(struct iovec iov[], device devs[], int num_devs)
+{
+    int res = 0;
+    // CREATE NEW UDP SOCKET
+    count_sys();
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0)
+    {
+        return sockfd;
+    }
+
+    struct sockaddr_in sin[MAX_DEVS];
+    int n = 0;
+    for (; n < num_devs; n++)
+    {
+        sin[n].sin_family = AF_INET;
+        sin[n].sin_port = htons(PORT);
+        if (inet_aton(devs[n].ip, &(sin[n].sin_addr)) == 0)
+        {
+            fprintf(stderr, "error parsing ip address\n");
+            res = -1;
+            break;
+        }
+    }
+
+    // devices listed before an unparseable address are still sent the request
+    if (send_batch(sockfd, iov, sin, n) < 0)
+    {
+        fprintf(stderr, "error sending request\n");
+        res = -1;
+    }
+
+    count_sys();
+    if (close(sockfd) < 0)
+    {
+        res = -1;
+    }
+
+    return res;
+}
+
+dev_stats *open_stats(char *path)
+{
+    count_sys();
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+        return NULL;
+
+    // a file written with a different record layout is discarded rather than misread
+    size_t size = sizeof(dev_stats) * MAX_DEVS;
+    struct stat sb;
+    count_sys();
+    int res = fstat(fd, &sb);
+    if (res == 0 && (size_t)sb.st_size != size)
+    {
+        count_sys();
+        res = ftruncate(fd, 0);
+    }
+    if (res == 0)
+    {
+        count_sys();
+        res = ftruncate(fd, size);
+    }
+    if (res < 0)
+    {
+        count_sys();
+        close(fd);
+        return NULL;
+    }
+
+    count_sys();
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    count_sys();
+    close(fd);
+    if (p == MAP_FAILED)
+        return NULL;
+    return p;
+}
+
+int close_stats(dev_stats *stats)
+{
+    count_sys();
+    return munmap(stats, sizeof(dev_stats) * MAX_DEVS);
+}
+
+// stats_find returns the record for key, claiming an empty one if the key is new. If the table is full, the least recently used record is given to the new key.
+static dev_stats *stats_find(dev_stats *stats, char *key)
+{
+    uint32_t now = time(NULL);
+    dev_stats *st = NULL;
+    for (int i = 0; i < MAX_DEVS; i++)
+    {
+        if (stats[i].key[0] != '\0' && strncmp(stats[i].key, key, STATS_KEY - 1) == 0)
+        {
+            stats[i].used = now;
+            return &stats[i];
+        }
+        if (st == NULL || (st->key[0] != '\0' && (stats[i].key[0] == '\0' || stats[i].used < st->used)))
+            st = &stats[i];
+    }
+
+    memset(st, 0, sizeof(dev_stats));
+    strncpy(st->key, key, STATS_KEY - 1);
+    st->used = now;
+    return st;
+}
+
+// stats_tries returns the number of attempts needed to reach a device with 99% confidence, given its observed loss rate. The estimate starts from a prior loss rate of 20%, which gives a device with no history 3 attempts, and falls with each reply until a device with a clean record of 24 or more packets is sent a single one. A reply never increases the number of attempts, and halving the history in stats_sent keeps enough of it to stay at a single attempt.
+static int stats_tries(dev_stats *st)
+{
+    dev_stats none = {};
+    if (st == NULL)
+        st = &none;
+
+    double loss = (st->sent - st->acked + 0.25) / (st->sent + 1.25);
+    double miss = loss;
+    int tries = 1;
+    while (miss > 0.01 && tries < MAX_TRIES)
+    {
+        miss *= loss;
+        tries++;
+    }
+    return tries;
+}
+
+// stats_timeout returns how long to wait for a reply from a device, in microseconds.
+static int64_t stats_timeout(dev_stats *st)
+{
+    if (st == NULL || st->acked == 0)
+        return 250000;
+    return clamp(20000, 1000000, st->srtt + 4 * st->rttvar);
+}
+
+// stats_sent records an outgoing packet. Old history is halved so that the table tracks recent behavior.
+static void stats_sent(dev_stats *st)
+{
+    if (st == NULL)
+        return;
+    if (st->sent >= 64)
+    {
+        st->sent /= 2;
+        st->acked /= 2;
+    }
+    st->sent++;
+}
+
+// stats_acked records a reply that arrived rtt microseconds after the request was sent. A negative rtt records the reply without a round trip time sample.
+static void stats_acked(dev_stats *st, int64_t rtt)
+{
+    if (st == NULL)
+        return;
+    if (st->acked < st->sent)
+        st->acked++;
+    if (rtt < 0)
+        return;
+    if (st->srtt == 0)
+    {
+        st->srtt = rtt;
+        st->rttvar = rtt / 2;
+        return;
+    }
+    int64_t delta = rtt - st->srtt;
+    if (delta < 0)
+        delta = -delta;
+    st->rttvar = (3 * (int64_t)st->rttvar + delta) / 4;
+    st->srtt = (7 * (int64_t)st->srtt + rtt) / 8;
+}
+
+static void trace_write(uint8_t kind, struct in_addr addr, int32_t id, struct timespec *ts)
+{
+    if (ts->tv_sec == 0 && ts->tv_nsec == 0)
+        return;
+    struct trace_rec rec = {};
+    rec.kind = kind;
+    rec.addr = addr.s_addr;
+    rec.id = id;
+    rec.ns = (int64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+    fwrite(&rec, sizeof(rec), 1, trace_fp);
+}
+
+// enable_timestamping asks the kernel to report software and hardware timestamps for each datagram sent or received on sockfd.
+static int enable_timestamping(int sockfd)
+{
+    int flags = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_TX_HARDWARE |
+                SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_RX_HARDWARE |
+                SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_RAW_HARDWARE |
+                SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+    count_sys();
+    return setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags));
+}
+
+// find_timestamps returns the SCM_TIMESTAMPING payload of h, or NULL if there is none.
+static struct scm_timestamping *find_timestamps(struct msghdr *h)
+{
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(h); c != NULL; c = CMSG_NXTHDR(h, c))
+    {
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPING)
+            return (struct scm_timestamping *)CMSG_DATA(c);
+    }
+    return NULL;
+}
+
+// drain_tx_timestamps reads the transmit timestamps queued on the socket's error queue. Each timestamp carries the index of the datagram it belongs to, which is looked up in tx_dev and tx_id.
+static void drain_tx_timestamps(int sockfd, struct sockaddr_in sin[], int tx_dev[], int32_t tx_id[], int num_tx)
+{
+    char control[256];
+    for (;;)
+    {
+        struct msghdr h = {};
+        h.msg_control = control;
+        h.msg_controllen = sizeof(control);
+        count_sys();
+        if (recvmsg(sockfd, &h, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+            return;
+
+        struct scm_timestamping *ts = find_timestamps(&h);
+        struct sock_extended_err *ee = NULL;
+        for (struct cmsghdr *c = CMSG_FIRSTHDR(&h); c != NULL; c = CMSG_NXTHDR(&h, c))
+        {
+            if (c->cmsg_level == SOL_IP && c->cmsg_type == IP_RECVERR)
+                ee = (struct sock_extended_err *)CMSG_DATA(c);
+        }
+        if (ts == NULL || ee == NULL || ee->ee_origin != SO_EE_ORIGIN_TIMESTAMPING || ee->ee_data >= (uint32_t)num_tx)
+            continue;
+
+        int k = ee->ee_data;
+        trace_write(TRACE_TX_SW, sin[tx_dev[k]].sin_addr, tx_id[k], &ts->ts[0]);
+        trace_write(TRACE_TX_HW, sin[tx_dev[k]].sin_addr, tx_id[k], &ts->ts[2]);
+    }
+}
+
+// msg_with_id copies msg to dst with its request id replaced by id and returns the new length.
+static int msg_with_id(char *dst, char *msg, int mlen, int id)
+{
+    const char prefix[] = "{\"id\":1,";
+    int plen = sizeof(prefix) - 1;
+    if (mlen < plen || strncmp(msg, prefix, plen) != 0)
+    {
+        memcpy(dst, msg, mlen);
+        return mlen;
+    }
+    int n = sprintf(dst, "{\"id\":%d,", id);
+    memcpy(&dst[n], &msg[plen], mlen - plen);
+    return n + mlen - plen;
+}
+
+// json_field returns a pointer to the start of the value of the first field named key in the json in buf, or NULL if there is no such field.
+static char *json_field(char *buf, const char *key)
+{
+    char quoted[32];
+    snprintf(quoted, sizeof(quoted), "\"%s\"", key);
+    char *p = strstr(buf, quoted);
+    if (p == NULL)
+        return NULL;
+    p += strlen(quoted);
+    while (*p == ' ' || *p == ':')
+        p++;
+    return p;
+}
+
+// reply_id returns the request id echoed in a device's json reply, or 0 if it has none.
+static int32_t reply_id(char *buf)
+{
+    char *p = json_field(buf, "id");
+    return (p == NULL) ? 0 : atoi(p);
+}
+
+int send_cmds_adaptive(char *msg, int mlen, device devs[], int num_devs, dev_stats *stats, bool missed[])
+{
+    count_sys();
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0)
+    {
+        perror(NULL);
+        return -1;
+    }
+    if (trace_fp != NULL && enable_timestamping(sockfd) < 0)
+    {
+        fprintf(stderr, "unable to enable kernel timestamping\n");
+        perror(NULL);
+        count_sys();
+        close(sockfd);
+        return -1;
+    }
+
+    struct sockaddr_in sin[MAX_DEVS];
+    dev_stats *st[MAX_DEVS];
+    int tries[MAX_DEVS];
+    int64_t sent_at[MAX_DEVS];
+    bool pending[MAX_DEVS];
+    bool in_round[MAX_DEVS];
+    // every datagram sent, in order, for matching kernel transmit timestamps
+    int tx_dev[MAX_DEVS * MAX_TRIES];
+    int32_t tx_id[MAX_DEVS * MAX_TRIES];
+    int num_tx = 0;
+    int res = 0;
+
+    for (int i = 0; i < num_devs; i++)
+    {
+        sin[i].sin_family = AF_INET;
+        sin[i].sin_port = htons(PORT);
+        if (inet_aton(devs[i].ip, &(sin[i].sin_addr)) == 0)
+        {
+            fprintf(stderr, "error parsing ip address\n");
+            count_sys();
+            close(sockfd);
+            return -1;
+        }
+        st[i] = stats_find(stats, devs[i].name);
+        tries[i] = stats_tries(st[i]);
+        pending[i] = true;
+    }
+
+    for (int round = 0; round < MAX_TRIES; round++)
+    {
+        // each round carries its own request id so that replies can be matched to the attempt that produced them
+        int32_t id = round + 1;
+        char round_msg[MAX_REQ + 16];
+        int round_len = msg_with_id(round_msg, msg, mlen, id);
+
+        struct sockaddr_in dst[MAX_DEVS];
+        struct iovec iov[MAX_DEVS];
+        int64_t wait = 0;
+        int in_flight = 0;
+        for (int i = 0; i < num_devs; i++)
+        {
+            in_round[i] = pending[i] && round < tries[i];
+            if (!in_round[i])
+                continue;
+            tx_dev[num_tx] = i;
+            tx_id[num_tx++] = id;
+            iov[in_flight].iov_base = round_msg;
+            iov[in_flight].iov_len = round_len;
+            dst[in_flight++] = sin[i];
+            stats_sent(st[i]);
+            wait = (stats_timeout(st[i]) > wait) ? stats_timeout(st[i]) : wait;
+        }
+        if (in_flight == 0)
+            break;
+
+        int64_t t = now_us();
+        if (send_batch(sockfd, iov, dst, in_flight) < 0)
+        {
+            fprintf(stderr, "error sending request\n");
+            count_sys();
+            close(sockfd);
+            return -1;
+        }
+        for (int i = 0; i < num_devs; i++)
+        {
+            if (in_round[i])
+                sent_at[i] = t;
+        }
+
+        // collect replies until every device in this round has answered or the longest timeout elapses
+        int64_t deadline = now_us() + wait;
+        char buf[1024 + 1];
+        char control[256];
+        while (in_flight > 0)
+        {
+            int64_t left = deadline - now_us();
+            if (left <= 0)
+                break;
+            struct pollfd pfd = {sockfd, POLLIN, 0};
+            count_sys();
+            int ready = poll(&pfd, 1, (left + 999) / 1000);
+            if (ready < 0 && errno != EINTR)
+            {
+                perror(NULL);
+                count_sys();
+                close(sockfd);
+                return -1;
+            }
+            if (ready <= 0)
+                continue;
+            if (pfd.revents & POLLERR)
+                drain_tx_timestamps(sockfd, sin, tx_dev, tx_id, num_tx);
+            if (!(pfd.revents & POLLIN))
+                continue;
+
+            struct sockaddr_in from;
+            struct iovec iov = {buf, sizeof(buf) - 1};
+            struct msghdr h = {};
+            h.msg_name = &from;
+            h.msg_namelen = sizeof(from);
+            h.msg_iov = &iov;
+            h.msg_iovlen = 1;
+            h.msg_control = control;
+            h.msg_controllen = sizeof(control);
+            count_sys();
+            ssize_t got = recvmsg(sockfd, &h, MSG_DONTWAIT);
+            if (got < 0)
+                continue;
+            count_rx(1, got);
+            if (capture_fp != NULL)
+                capture_pkt(CAPTURE_RX, &from, buf, got);
+            buf[got] = '\0';
+            int32_t rid = reply_id(buf);
+
+            if (trace_fp != NULL)
+            {
+                struct scm_timestamping *ts = find_timestamps(&h);
+                if (ts != NULL)
+                {
+                    trace_write(TRACE_RX_SW, from.sin_addr, rid, &ts->ts[0]);
+                    trace_write(TRACE_RX_HW, from.sin_addr, rid, &ts->ts[2]);
+                }
+            }
+
+            for (int i = 0; i < num_devs; i++)
+            {
+                if (pending[i] && sin[i].sin_addr.s_addr == from.sin_addr.s_addr)
+                {
+                    pending[i] = false;
+                    // only a reply to the latest attempt gives an unambiguous round trip time
+                    stats_acked(st[i], (rid == id && in_round[i]) ? now_us() - sent_at[i] : -1);
+                    if (in_round[i])
+                        in_flight--;
+                    break;
+                }
+            }
+        }
     }
 
-    if (args.broadcast)
+    if (trace_fp != NULL)
     {
-        for (int i = 0; i <= args.repeat; i++)
+        // transmit timestamps are normally queued long before the replies arrive; pick up any stragglers
+        struct pollfd pfd = {sockfd, 0, 0};
+        for (;;)
         {
-            exit_status = msg_all(args);
+            count_sys();
+            if (poll(&pfd, 1, 10) <= 0 || !(pfd.revents & POLLERR))
+                break;
+            drain_tx_timestamps(sockfd, sin, tx_dev, tx_id, num_tx);
         }
-        return exit_status;
     }
 
-    if (args.ips != NULL)
+    for (int i = 0; i < num_devs; i++)
     {
-        for (int i = 0; i <= args.repeat; i++)
+        if (missed != NULL)
+            missed[i] = pending[i];
+        if (pending[i])
         {
-            exit_status = use_ips(args);
+            fprintf(stderr, "no response from %s (%s)\n", devs[i].name, devs[i].ip);
+            res++;
         }
-        return exit_status;
     }
 
-    char wiz_path[PATH_MAX];
-    char *wiz_path_tmp;
-    // first check if WIZ_PATH is defined...
-    wiz_path_tmp = getenv("WIZ_PATH");
-    if (wiz_path_tmp == NULL) {
-        // then look to see if the XDG_DATA_HOME dir is something other than expected
-        wiz_path_tmp = getenv("XDG_DATA_HOME");
-        if (wiz_path_tmp == NULL) {
-            // finally, go with the default
-            wiz_path_tmp = getenv("HOME");
-            if (wiz_path_tmp == NULL) {
-                fprintf(stderr, "unable to determine user's home directory\n");
-                return EXIT_FAILURE;
-            }
-            sprintf(wiz_path, "%s/.local/share/wiz.csv", wiz_path_tmp);
-        } else {
-            sprintf(wiz_path, "%s/wiz.csv", wiz_path_tmp);
-        }
-    } else {
-        strncpy(wiz_path, wiz_path_tmp, PATH_MAX);
-    }
-        
+    count_sys();
+    if (close(sockfd) < 0)
+        return -1;
+    return res;
+}
 
-    // load the device configs into memory
-    struct stat fstat;
-    if ((stat(wiz_path, &fstat)) < 0)
+int parse_mac(const char *s, uint8_t mac[6])
+{
+    int n = 0;
+    for (; *s && n < 12; s++)
     {
-        fprintf(stderr, "unable to stat device configuration file\n");
-        perror(NULL);
-        // attempt to create this file if possible
-        FILE *tmp_fp = fopen(wiz_path, "w");
-        if (tmp_fp != NULL)
-            fclose(tmp_fp);
+        if (*s == ':' || *s == '-')
+            continue;
+        int v;
+        if (*s >= '0' && *s <= '9')
+            v = *s - '0';
+        else if (tolower((unsigned char)*s) >= 'a' && tolower((unsigned char)*s) <= 'f')
+            v = tolower((unsigned char)*s) - 'a' + 10;
+        else
+            return -1;
+        mac[n / 2] = (n % 2) ? (mac[n / 2] | v) : (v << 4);
+        n++;
+    }
+    return (n == 12 && *s == '\0') ? 0 : -1;
+}
 
-        return EXIT_FAILURE;
+int read_neighbors(neighbor nbs[], int max)
+{
+    count_sys();
+    int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (fd < 0)
+        return -1;
+
+    struct
+    {
+        struct nlmsghdr nh;
+        struct ndmsg nd;
+    } req = {};
+    req.nh.nlmsg_len = sizeof(req);
+    req.nh.nlmsg_type = RTM_GETNEIGH;
+    req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    req.nd.ndm_family = AF_INET;
+    count_sys();
+    if (send(fd, &req, sizeof(req), 0) < 0)
+    {
+        count_sys();
+        close(fd);
+        return -1;
     }
-    if (fstat.st_size == 0)
+
+    int n = 0;
+    char buf[16384] __attribute__((aligned(NLMSG_ALIGNTO)));
+    for (;;)
     {
-        fprintf(stderr, "device configuration file is empty\n");
-        // attempt to create this file if possible
-        FILE *tmp_fp = fopen(wiz_path, "w");
-        if (tmp_fp != NULL)
-            fclose(tmp_fp);
+        count_sys();
+        ssize_t len = recv(fd, buf, sizeof(buf), 0);
+        if (len <= 0)
+            break;
 
-        return EXIT_FAILURE;
+        for (struct nlmsghdr *nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len))
+        {
+            if (nh->nlmsg_type == NLMSG_DONE || nh->nlmsg_type == NLMSG_ERROR)
+                goto done;
+            if (nh->nlmsg_type != RTM_NEWNEIGH)
+                continue;
+
+            struct ndmsg *nd = NLMSG_DATA(nh);
+            if (nd->ndm_state & (NUD_INCOMPLETE | NUD_FAILED | NUD_NOARP))
+                continue;
+
+            neighbor nb = {};
+            bool has_dst = false, has_mac = false;
+            int attr_len = RTM_PAYLOAD(nh);
+            for (struct rtattr *rta = RTM_RTA(nd); RTA_OK(rta, attr_len); rta = RTA_NEXT(rta, attr_len))
+            {
+                if (rta->rta_type == NDA_DST && RTA_PAYLOAD(rta) == sizeof(nb.addr))
+                {
+                    memcpy(&nb.addr, RTA_DATA(rta), sizeof(nb.addr));
+                    has_dst = true;
+                }
+                else if (rta->rta_type == NDA_LLADDR && RTA_PAYLOAD(rta) == sizeof(nb.mac))
+                {
+                    memcpy(nb.mac, RTA_DATA(rta), sizeof(nb.mac));
+                    has_mac = true;
+                }
+            }
+            if (has_dst && has_mac && n < max)
+                nbs[n++] = nb;
+        }
     }
-    char *buf = malloc(fstat.st_size + 1);
 
-    FILE *fp = fopen(wiz_path, "r");
-    if (fp == NULL)
+done:
+    count_sys();
+    close(fd);
+    return n;
+}
+
+// reply_mac finds the mac address in a getDevInfo reply. It returns 0 on success or -1 if the reply has none.
+static int reply_mac(char *buf, uint8_t mac[6])
+{
+    char *p = json_field(buf, "mac");
+    if (p == NULL || *p != '"')
+        return -1;
+    char hex[13] = "";
+    strncpy(hex, p + 1, 12);
+    return parse_mac(hex, mac);
+}
+
+int sweep_macs(struct in_addr subnet, uint8_t macs[][6], struct in_addr found[], int n)
+{
+    count_sys();
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0)
     {
-        fprintf(stderr, "unable to open device configuration file\n");
         perror(NULL);
-        exit_status = EXIT_FAILURE;
-        goto end;
+        return -1;
     }
-    if (fread(buf, fstat.st_size, 1, fp) == 0)
+
+    // ask every host on the /24 for its device info
+    struct sockaddr_in dst[254];
+    struct iovec iov[254];
+    uint32_t base = ntohl(subnet.s_addr) & 0xffffff00;
+    for (int i = 0; i < 254; i++)
     {
-        fprintf(stderr, "unable to read device configuration file\n");
-        exit_status = EXIT_FAILURE;
-        goto end;
+        dst[i].sin_family = AF_INET;
+        dst[i].sin_port = htons(PORT);
+        dst[i].sin_addr.s_addr = htonl(base | (i + 1));
+        iov[i].iov_base = INFO;
+        iov[i].iov_len = sizeof(INFO);
     }
-    if (fclose(fp) < 0)
+    if (send_batch(sockfd, iov, dst, 254) < 0)
     {
-        fprintf(stderr, "unable to close device configuration file\n");
-        perror(NULL);
-        exit_status = EXIT_FAILURE;
-        goto end;
+        count_sys();
+        close(sockfd);
+        return -1;
     }
 
-    // parse devices names/ips from the config file
-    device devs[MAX_DEVS];
-    int n = 0;
-    n = parse_csv(buf, fstat.st_size + 1, devs, args.name, args.room);
-    if (n < 0)
-    {
-        perror(NULL);
-        exit_status = EXIT_FAILURE;
-        goto end;
-    }
-    if (n == 0)
+    int left = n;
+    int64_t deadline = now_us() + SWEEP_TIMEOUT;
+    char buf[1024 + 1];
+    while (left > 0)
     {
-        fprintf(stderr, "no devices read from the configuration file\n");
-        exit_status = EXIT_FAILURE;
-        goto end;
+        int64_t wait = deadline - now_us();
+        if (wait <= 0)
+            break;
+        struct pollfd pfd = {sockfd, POLLIN, 0};
+        count_sys();
+        if (poll(&pfd, 1, (wait + 999) / 1000) <= 0)
+            continue;
+
+        struct sockaddr_in from;
+        socklen_t fromlen = sizeof(from);
+        count_sys();
+        ssize_t got = recvfrom(sockfd, buf, sizeof(buf) - 1, MSG_DONTWAIT, (struct sockaddr *)(&from), &fromlen);
+        if (got <= 0)
+            continue;
+        count_rx(1, got);
+        if (capture_fp != NULL)
+            capture_pkt(CAPTURE_RX, &from, buf, got);
+        buf[got] = '\0';
+
+        uint8_t mac[6];
+        if (reply_mac(buf, mac) < 0)
+            continue;
+        for (int i = 0; i < n; i++)
+        {
+            if (found[i].s_addr == 0 && memcmp(mac, macs[i], 6) == 0)
+            {
+                found[i] = from.sin_addr;
+                left--;
+            }
+        }
     }
 
-   
-    char msg[MAX_REQ];
-    int mlen = json_msg(msg, args);
-    if (mlen < 0) {
-        fprintf(stderr, "error writing json message: %s\n", msg);
-        goto end;
+    count_sys();
+    close(sockfd);
+    return n - left;
+}
+
+int resolve_macs(device devs[], int n, bool missed[], struct in_addr found[])
+{
+    uint8_t macs[MAX_DEVS][6];
+    bool todo[MAX_DEVS];
+    int resolved = 0;
+    for (int i = 0; i < n; i++)
+    {
+        found[i].s_addr = 0;
+        todo[i] = missed[i] && devs[i].mac != NULL && parse_mac(devs[i].mac, macs[i]) == 0;
     }
 
-    if (args.list)
+    // the kernel's neighbor table is free to read, so try it first
+    static neighbor nbs[1024];
+    int num_nbs = read_neighbors(nbs, 1024);
+    for (int i = 0; i < n; i++)
     {
-        printf("Devices\n");
-        printf("NAME\tIP ADDRESS\tROOM\n");
-        for (int i = 0; i < n; i++)
+        if (!todo[i])
+            continue;
+        for (int j = 0; j < num_nbs; j++)
         {
-            printf("%s\t%s", devs[i].name, devs[i].ip);
-            if (devs[i].room == NULL)
-                printf("\n");
-            else
-                printf("\t%s\n", devs[i].room);
+            if (memcmp(nbs[j].mac, macs[i], 6) == 0 && strcmp(inet_ntoa(nbs[j].addr), devs[i].ip) != 0)
+            {
+                found[i] = nbs[j].addr;
+                todo[i] = false;
+                resolved++;
+                break;
+            }
         }
     }
 
-    for (int i = 0; i <= args.repeat; i++)
+    // then ask every host on the remaining devices' last known subnets who they are, one sweep per subnet
+    for (int i = 0; i < n; i++)
     {
-        if (send_cmds(msg, mlen, devs, n) < 0)
+        struct in_addr subnet;
+        if (!todo[i] || inet_aton(devs[i].ip, &subnet) == 0)
+            continue;
+
+        uint8_t want[MAX_DEVS][6];
+        struct in_addr got[MAX_DEVS];
+        int idx[MAX_DEVS];
+        int k = 0;
+        for (int j = i; j < n; j++)
         {
-            fprintf(stderr, "error sending cmds\n");
-            exit_status = EXIT_FAILURE;
+            struct in_addr other;
+            if (!todo[j] || inet_aton(devs[j].ip, &other) == 0)
+                continue;
+            if ((ntohl(other.s_addr) & 0xffffff00) != (ntohl(subnet.s_addr) & 0xffffff00))
+                continue;
+            memcpy(want[k], macs[j], 6);
+            got[k].s_addr = 0;
+            todo[j] = false;
+            idx[k++] = j;
+        }
+        if (sweep_macs(subnet, want, got, k) < 0)
+            continue;
+        for (int j = 0; j < k; j++)
+        {
+            if (got[j].s_addr == 0)
+                continue;
+            found[idx[j]] = got[j];
+            resolved++;
         }
     }
-
-end:
-    free(buf);
-
-    return exit_status;
+    return resolved;
 }
 
-int send_cmds(char *msg, int mlen, device devs[], int num_devs)
+int write_config_ips(char *path, device devs[], struct in_addr found[], int n)
 {
-    int res = 0;
-    // CREATE NEW UDP SOCKET
-    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sockfd < 0)
+    long size;
+    char *buf = read_config(path, &size, false);
+    if (buf == NULL)
+        return -1;
+
+    // keep the file's permissions
+    struct stat sb;
+    count_sys();
+    if (stat(path, &sb) < 0)
     {
-        return sockfd;
+        perror(NULL);
+        free(buf);
+        return -1;
     }
 
-    struct sockaddr_in sin;
-    sin.sin_family = AF_INET;
-    sin.sin_port = htons(PORT);
+    // the temporary file must be in the same directory for the rename to be atomic, and uniquely named in case another wiz is doing the same
+    char tmp_path[PATH_MAX + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path);
+    count_sys();
+    int fd = mkstemp(tmp_path);
+    if (fd < 0)
+    {
+        perror(NULL);
+        free(buf);
+        return -1;
+    }
+    count_sys();
+    FILE *fp = NULL;
+    if (fchmod(fd, sb.st_mode & 07777) == 0)
+        fp = fdopen(fd, "w");
+    if (fp == NULL)
+    {
+        perror(NULL);
+        count_sys();
+        close(fd);
+        count_sys();
+        unlink(tmp_path);
+        free(buf);
+        return -1;
+    }
 
-    for (int i = 0; i < num_devs; i++)
+    for (char *line = buf; line < buf + size;)
     {
-        if (inet_aton(devs[i].ip, &(sin.sin_addr)) == 0)
+        char *end = memchr(line, '\n', buf + size - line);
+        int len = (end == NULL) ? buf + size - line : end - line + 1;
+        char *name_end = memchr(line, ',', len);
+        char *ip_end = (name_end == NULL) ? NULL : strpbrk(name_end + 1, ",\n");
+
+        bool replaced = false;
+        for (int i = 0; i < n && name_end != NULL; i++)
         {
-            fprintf(stderr, "error parsing ip address\n");
-            res = -1;
+            if (found[i].s_addr == 0)
+                continue;
+            size_t name_len = name_end - line;
+            if (strlen(devs[i].name) != name_len || strncmp(line, devs[i].name, name_len) != 0)
+                continue;
+            fwrite(line, name_len + 1, 1, fp);
+            fputs(inet_ntoa(found[i]), fp);
+            if (ip_end != NULL && ip_end < line + len)
+                fwrite(ip_end, line + len - ip_end, 1, fp);
+            replaced = true;
             break;
         }
-        socklen_t len = sizeof(sin);
-        if (sendto(sockfd, (void *)msg, mlen, 0, (struct sockaddr *)(&sin), len) < 0)
+        if (!replaced)
+            fwrite(line, len, 1, fp);
+        line += len;
+    }
+    free(buf);
+
+    count_sys();
+    int res = fclose(fp);
+    if (res == 0)
+    {
+        count_sys();
+        res = rename(tmp_path, path);
+    }
+    if (res != 0)
+    {
+        perror(NULL);
+        count_sys();
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+int retry_resolved(char *msg, int mlen, device devs[], int n, bool missed[], dev_stats *stats, char *wiz_path)
+{
+    struct in_addr found[MAX_DEVS];
+    int resolved = resolve_macs(devs, n, missed, found);
+
+    static char ips[MAX_DEVS][INET_ADDRSTRLEN];
+    device moved[MAX_DEVS];
+    int moved_from[MAX_DEVS];
+    int k = 0;
+    int res = 0;
+    for (int i = 0; i < n; i++)
+    {
+        if (found[i].s_addr == 0)
         {
-            fprintf(stderr, "error sending request\n");
-            perror(NULL);
-            res = -1;
-            break;
-        };
+            // devices that were missed and could not be found still count as failures
+            if (missed[i])
+                res++;
+            continue;
+        }
+        inet_ntop(AF_INET, &found[i], ips[k], INET_ADDRSTRLEN);
+        moved[k] = devs[i];
+        moved[k].ip = ips[k];
+        moved_from[k++] = i;
     }
+    if (resolved == 0)
+        return res;
 
-    if (close(sockfd) < 0)
+    bool still_missed[MAX_DEVS];
+    int retry = send_cmds_adaptive(msg, mlen, moved, k, stats, still_missed);
+    if (retry < 0)
+        return retry;
+
+    // a neighbor table entry can be stale, so only addresses the device has answered from are written back
+    int confirmed = 0;
+    for (int j = 0; j < k; j++)
     {
-        res = -1;
+        int i = moved_from[j];
+        if (still_missed[j])
+        {
+            found[i].s_addr = 0;
+            continue;
+        }
+        fprintf(stderr, "%s moved from %s to %s\n", devs[i].name, devs[i].ip, ips[j]);
+        confirmed++;
     }
+    if (confirmed > 0 && write_config_ips(wiz_path, devs, found, n) < 0)
+        fprintf(stderr, "unable to update device configuration file\n");
 
-    return res;
+    return res + retry;
 }
 
 static error_t parse_opt(int key, char *arg, struct argp_state *state)
@@ -260,6 +1697,9 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 
     switch (key)
     {
+    case 'a':
+        arg_info->adaptive = true;
+        break;
     case 'b':
         arg_info->broadcast = true;
         break;
@@ -268,13 +1708,47 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
         {
             fprintf(stderr, "unable to parse color\n");
             argp_usage(state);
+            return EINVAL;
         }
+        int c = color_index(arg);
+        arg_info->col_json = (c < 0) ? NULL : color_json[c];
         arg_info->change_col = true;
         break;
     case 'd':
         arg_info->discover = true;
         sscanf(arg, "%d,%d", &(arg_info->seconds), &(arg_info->num_devs));
         break;
+    case 'e':
+        if (strcmp(arg, "plain") == 0)
+            batch_send = false;
+        else if (strcmp(arg, "batch") == 0)
+            batch_send = true;
+        else
+        {
+            fprintf(stderr, "unknown send engine\n");
+            argp_usage(state);
+            return EINVAL;
+        }
+        break;
+    case OPT_GRADIENT:
+    {
+        char *to = strchr(arg, ':');
+        if (to == NULL)
+        {
+            fprintf(stderr, "gradient must be given as FROM:TO\n");
+            argp_usage(state);
+            return EINVAL;
+        }
+        *to++ = '\0';
+        if (init_color(&arg_info->grad_from, arg) || init_color(&arg_info->grad_to, to))
+        {
+            fprintf(stderr, "unable to parse color\n");
+            argp_usage(state);
+            return EINVAL;
+        }
+        arg_info->gradient = true;
+        break;
+    }
     case 'i':
         arg_info->ips = arg;
         break;
@@ -296,6 +1770,20 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
     case 'r':
         arg_info->room = arg;
         break;
+    case OPT_TRACE:
+        arg_info->trace = arg;
+        arg_info->adaptive = true;
+        break;
+    case OPT_CAPTURE:
+        arg_info->capture = arg;
+        break;
+    case OPT_STDIN:
+        arg_info->read_stdin = true;
+        break;
+    case OPT_STATS:
+        arg_info->stats = true;
+        arg_info->stats_json = (arg != NULL && strcmp(arg, "json") == 0);
+        break;
     case 's':
         arg_info->scene = str_scene(arg);
         break;
@@ -317,25 +1805,10 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 int init_color(color *col, char *s)
 {
     // first check if s matches a named color.
-    int r = 0, g = 0, b = 0;
-    if (strcmp(s, "r") == 0)
-        r = 255;
-    else if (strcmp(s, "g") == 0)
-        g = 255;
-    else if (strcmp(s, "b") == 0)
-        b = 255;
-    else if (strcmp(s, "red") == 0)
-        r = 255;
-    else if (strcmp(s, "green") == 0)
-        g = 255;
-    else if (strcmp(s, "blue") == 0)
-        b = 255;
-
-    if (r || g || b)
-    {
-        col->r = r;
-        col->g = g;
-        col->b = b;
+    int i = color_index(s);
+    if (i >= 0)
+    {
+        *col = color_vals[i];
         return 0;
     }
 
@@ -344,6 +1817,18 @@ int init_color(color *col, char *s)
     return (n != 3);
 };
 
+// phf_lookup returns the slot of s in a perfect hash table generated by mktables, or -1 if s is not in the table.
+static int phf_lookup(const uint16_t disp[], const char *const names[], int n, const char *s)
+{
+    uint32_t i = name_hash(disp[name_hash(0, s) % n], s) % n;
+    return (strcasecmp(names[i], s) == 0) ? (int)i : -1;
+}
+
+int color_index(const char *s)
+{
+    return phf_lookup(color_disp, color_names, COLOR_TABLE_LEN, s);
+}
+
 
 
 
@@ -354,11 +1839,13 @@ int parse_csv(char *data, int n, device devs[], char *search_names, char *search
     char *name;
     char *ip;
     char *room;
+    char *mac;
     bool find_name = true;
     int i = 0;
 
 find_name:
     name = &data[i];
+    mac = NULL;
     for (; i < n; i++)
     {
         if (data[i] == ',')
@@ -394,6 +1881,7 @@ find_ip:
                     devs[d].name = name;
                     devs[d].ip = ip;
                     devs[d].room = NULL;
+                    devs[d].mac = NULL;
                     d++;
                 }
             }
@@ -402,6 +1890,7 @@ find_ip:
                 devs[d].name = name;
                 devs[d].ip = ip;
                 devs[d].room = NULL;
+                devs[d].mac = NULL;
                 d++;
             }
             i++;
@@ -413,7 +1902,13 @@ find_group:
     room = &data[i];
     for (; i < n; i++)
     {
-        if (data[i] == '\n')
+        // an optional fourth column holds the device's mac address
+        if (data[i] == ',' && mac == NULL)
+        {
+            data[i] = '\0';
+            mac = &data[i + 1];
+        }
+        else if (data[i] == '\n')
         {
             data[i] = '\0';
             if (search_names != NULL && search_rooms != NULL)
@@ -423,6 +1918,7 @@ find_group:
                     devs[d].name = name;
                     devs[d].ip = ip;
                     devs[d].room = room;
+                    devs[d].mac = mac;
                     d++;
                 }
             }
@@ -433,6 +1929,7 @@ find_group:
                     devs[d].name = name;
                     devs[d].ip = ip;
                     devs[d].room = room;
+                    devs[d].mac = mac;
                     d++;
                 }
             }
@@ -443,6 +1940,7 @@ find_group:
                     devs[d].name = name;
                     devs[d].ip = ip;
                     devs[d].room = room;
+                    devs[d].mac = mac;
                     d++;
                 }
             }
@@ -451,6 +1949,7 @@ find_group:
                 devs[d].name = name;
                 devs[d].ip = ip;
                 devs[d].room = room;
+                devs[d].mac = mac;
                 d++;
             }
             i++;
@@ -485,53 +1984,10 @@ int parse_ips(char *src, device devs[])
     return n;
 }
 
-static char *scene_strs[] = {
-    "ocean",
-    "romance",
-    "sunset",
-    "party",
-    "fireplace",
-    "cozy",
-    "forest",
-    "pastel_colors",
-    "wake_up",
-    "bedtime",
-    "warm_white",
-    "daylight",
-    "cool_white",
-    "night_light",
-    "focus",
-    "relax",
-    "true_colors",
-    "tv_time",
-    "plant_growth",
-    "spring",
-    "summer",
-    "fall",
-    "deep_dive",
-    "jungle",
-    "mojito",
-    "club",
-    "christmas",
-    "halloween",
-    "candle_light",
-    "golden_white",
-    "pulse",
-    "steampunk",
-    "diwali",
-};
-
-scene str_scene(char *s)
+scene str_scene(const char *s)
 {
-    for (char *p = s; *p; p++)
-        *p = tolower(*p);
-
-    for (int i = 0; i < MAX_SCENE; i++)
-    {
-        if (strcmp(s, scene_strs[i]) == 0)
-            return i + 1;
-    }
-    return BAD_SCENE;
+    int i = phf_lookup(scene_disp, scene_names, SCENE_TABLE_LEN, s);
+    return (i < 0) ? BAD_SCENE : scene_ids[i];
 }
 
 bool is_in(char *s, char *list)
@@ -579,6 +2035,7 @@ int broadcast_udp_wait(char *msg, int mlen, int timeout, int max_resps)
 {
     int res = 0;
     // CREATE NEW UDP SOCKET
+    count_sys();
     int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
     if (sockfd < 0)
     {
@@ -587,9 +2044,11 @@ int broadcast_udp_wait(char *msg, int mlen, int timeout, int max_resps)
     }
 
     int broadcastEnable = 1;
+    count_sys();
     if (setsockopt(sockfd, SOL_SOCKET, SO_BROADCAST, &broadcastEnable, sizeof(broadcastEnable)) < 0)
     {
         perror(NULL);
+        count_sys();
         close(sockfd);
         return -1;
     }
@@ -601,10 +2060,12 @@ int broadcast_udp_wait(char *msg, int mlen, int timeout, int max_resps)
     tv.tv_sec = timeout;
     tv.tv_usec = 0;
 
+    count_sys();
     if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0)
     {
         perror(NULL);
         fprintf(stderr, "error setting socket\n");
+        count_sys();
         close(sockfd);
         return -1;
     }
@@ -614,13 +2075,18 @@ int broadcast_udp_wait(char *msg, int mlen, int timeout, int max_resps)
     sin.sin_port = htons(PORT);
     sin.sin_addr.s_addr = INADDR_BROADCAST;
 
+    count_sys();
     if (sendto(sockfd, (void *)msg, mlen, 0, (struct sockaddr *)(&sin), sizeof(sin)) < 0)
     {
         perror(NULL);
         fprintf(stderr, "send error\n");
+        count_sys();
         close(sockfd);
         return -1;
     }
+    count_tx(1, mlen);
+    if (capture_fp != NULL)
+        capture_pkt(CAPTURE_TX, &sin, msg, mlen);
 
     char buf[1024 + 1] = "";
     if (max_resps <= 0)
@@ -628,6 +2094,7 @@ int broadcast_udp_wait(char *msg, int mlen, int timeout, int max_resps)
     for (int i = 0; i < max_resps; i++)
     {
         int fromlen = sizeof(sin);
+        count_sys();
         ssize_t n = recvfrom(sockfd, buf, 1024, 0, (struct sockaddr *)(&sin), &fromlen);
         if (n < 0)
         {
@@ -636,12 +2103,17 @@ int broadcast_udp_wait(char *msg, int mlen, int timeout, int max_resps)
                 break;
             }
             fprintf(stderr, "recv error\n");
+            count_sys();
             close(sockfd);
             return -1;
         }
+        count_rx(1, n);
+        if (capture_fp != NULL)
+            capture_pkt(CAPTURE_RX, &sin, buf, n);
         char x[20] = "";
         printf("%s\n", inet_ntop(AF_INET, &sin.sin_addr.s_addr, x, INET_ADDRSTRLEN));
     }
+    count_sys();
     close(sockfd);
     return res;
 }
@@ -649,14 +2121,21 @@ int broadcast_udp_wait(char *msg, int mlen, int timeout, int max_resps)
 int msg_all(struct arg_vals a)
 {
     char buf[MAX_REQ];
+    int64_t t = phase_start();
     int n = json_msg(buf, a);
-    return broadcast_udp(buf, n);
+    phase_end(PHASE_ENCODE, t);
+
+    t = phase_start();
+    int res = broadcast_udp(buf, n);
+    phase_end(PHASE_SEND, t);
+    return res;
 }
 
 int broadcast_udp(char *msg, int mlen)
 {
     int res = 0;
     // CREATE NEW UDP SOCKET
+    count_sys();
     int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
     if (sockfd < 0)
     {
@@ -665,9 +2144,11 @@ int broadcast_udp(char *msg, int mlen)
     }
 
     int broadcastEnable = 1;
+    count_sys();
     if (setsockopt(sockfd, SOL_SOCKET, SO_BROADCAST, &broadcastEnable, sizeof(broadcastEnable)) < 0)
     {
         perror(NULL);
+        count_sys();
         close(sockfd);
         return -1;
     }
@@ -677,12 +2158,19 @@ int broadcast_udp(char *msg, int mlen)
     sin.sin_port = htons(PORT);
     sin.sin_addr.s_addr = INADDR_BROADCAST;
 
+    count_sys();
     if (sendto(sockfd, (void *)msg, mlen, 0, (struct sockaddr *)(&sin), sizeof(sin)) < 0)
     {
         perror(NULL);
         fprintf(stderr, "send error\n");
+        count_sys();
+        close(sockfd);
         return -1;
     }
+    count_tx(1, mlen);
+    if (capture_fp != NULL)
+        capture_pkt(CAPTURE_TX, &sin, msg, mlen);
+    count_sys();
     close(sockfd);
     return res;
 }
@@ -690,18 +2178,40 @@ int broadcast_udp(char *msg, int mlen)
 int use_ips(struct arg_vals args)
 {
     device devs[MAX_DEVS];
+    int64_t t = phase_start();
     int n = parse_ips(args.ips, devs);
+    phase_end(PHASE_PARSE, t);
     if (n < 1)
     {
         fprintf(stderr, "unable to parse ip addresses");
         return EXIT_FAILURE;
     }
     char msg[MAX_REQ];
-    int mlen = json_msg(msg, args);
-    return send_cmds(msg, mlen, devs, n);
+    static char msgs[MAX_DEVS][MAX_REQ];
+    int mlens[MAX_DEVS];
+    t = phase_start();
+    int mlen = (args.gradient) ? gradient_msgs(msgs, mlens, args, n) : json_msg(msg, args);
+    phase_end(PHASE_ENCODE, t);
+    if (mlen < 0)
+    {
+        fprintf(stderr, "error writing json message\n");
+        return EXIT_FAILURE;
+    }
+
+    t = phase_start();
+    int res = (args.gradient) ? send_cmds_each(msgs, mlens, devs, n) : send_cmds(msg, mlen, devs, n);
+    phase_end(PHASE_SEND, t);
+    return res;
 };
 
 
+// append copies the n bytes of s to p and returns the end of the copy.
+static char *append(char *p, const char *s, int n)
+{
+    memcpy(p, s, n);
+    return p + n;
+}
+
 int json_msg(char *buf, struct arg_vals args) {
     // setState cmds
     if (args.turn_on) { 
@@ -713,26 +2223,48 @@ int json_msg(char *buf, struct arg_vals args) {
         return sizeof(OFF);
     }
 
-    char col_str[64] = "";
-    char k_str[64] = "";
-    char scene_str[64] = "";
+    char *p = append(buf, SET_PILOT, sizeof(SET_PILOT) - 1);
 
-    // set exclusive pilot cmds
-    if (args.change_col) {sprintf(col_str, "\"r\":%u,\"g\":%u,\"b\":%u,", args.col.r, args.col.g, args.col.b);}
-    else if (args.kelvin){sprintf(k_str, "\"temp\":%d,", args.kelvin);}
-    else if (args.scene){sprintf(scene_str, "\"sceneId\":%d,", args.scene);}
-    
-    char dimming_str[64] = "";
-    char speed_str[64] = "";
-    // set additional parameters
-    if (args.dimming){sprintf(dimming_str, "\"dimming\":%d,", args.dimming-1);}
-    if (args.speed){sprintf(speed_str, "\"speed\":%d,", args.speed);};
+    // set exclusive pilot cmds; named colors and scenes are copied from pre-rendered fragments
+    if (args.change_col) {
+        if (args.col_json) { p = append(p, args.col_json, strlen(args.col_json)); }
+        else { p += sprintf(p, "\"r\":%u,\"g\":%u,\"b\":%u,", args.col.r, args.col.g, args.col.b); }
+    }
+    else if (args.kelvin){p += sprintf(p, "\"temp\":%d,", args.kelvin);}
+    else if (args.scene){p = append(p, scene_json[args.scene], strlen(scene_json[args.scene]));}
 
-    sprintf(buf, "{\"id\":1,\"method\":\"setPilot\",\"params\":{%s%s%s%s%s", col_str, k_str, scene_str, dimming_str, speed_str);
+    // set additional parameters
+    if (args.dimming){p += sprintf(p, "\"dimming\":%d,", args.dimming-1);}
+    if (args.speed){p += sprintf(p, "\"speed\":%d,", args.speed);};
 
-    int buf_len = strlen(buf);
+    *p = '\0';
+    int buf_len = p - buf;
     if (buf[buf_len-1] == '{') { return -1; }
 
     strcpy(&buf[buf_len-1], "}}");
     return buf_len + 1;
-}
\ No newline at end of file
+}
+
+int gradient_msgs(char msgs[][MAX_REQ], int mlens[], struct arg_vals args, int num_devs)
+{
+    static color_buf buf;
+    gradient_hsv(&buf, args.grad_from, args.grad_to, num_devs);
+    hsv_to_rgb(&buf);
+
+    // an explicit --dimming applies to every device; otherwise each device gets the brightness of its color
+    bool set_dimming = (args.dimming == 0);
+    args.change_col = true;
+    args.col_json = NULL;
+    for (int i = 0; i < num_devs; i++)
+    {
+        args.col.r = buf.r[i];
+        args.col.g = buf.g[i];
+        args.col.b = buf.b[i];
+        if (set_dimming)
+            args.dimming = buf.dimming[i] + 1;
+        mlens[i] = json_msg(msgs[i], args);
+        if (mlens[i] < 0)
+            return -1;
+    }
+    return 0;
+}
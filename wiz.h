@@ -1,3 +1,5 @@
+#include <ctype.h>
+#include <netinet/in.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
@@ -5,10 +7,20 @@
 #define PORT 38899
 #define MAX_DEVS 256
 #define MAX_REQ 128
+#define MAX_TRIES 5
+#define STATS_KEY 32
+#define COLOR_LANES 8
+#define SWEEP_TIMEOUT 500000 // microseconds
+#define TRACE_MAGIC 0x545a4957 // "WIZT" on disk
+#define TRACE_VERSION 1
+#define CAPTURE_MAGIC 0x435a4957 // "WIZC" on disk
+#define CAPTURE_VERSION 1
+#define CAPTURE_MAX_LEN 65507 // largest udp payload over ipv4
 
 #define OFF "{\"id\":1,\"method\":\"setState\",\"params\":{\"state\":false}}"
 #define ON "{\"id\":1,\"method\":\"setState\",\"params\":{\"state\":true}}"
 #define INFO "{\"id\":-2147483648,\"method\":\"getDevInfo\"}"
+#define SET_PILOT "{\"id\":1,\"method\":\"setPilot\",\"params\":{"
 
 typedef enum
 {
@@ -68,25 +80,160 @@ typedef struct color
     uint8_t b;
 } color;
 
+/*
+  A color_buf holds one color per device, stored as separate channel arrays (h, s, and v in [0, 1); r, g, and b in [0, 255]; dimming in [0, 100]) so that the batch color kernels can work on several devices at a time.
+ */
+typedef struct color_buf
+{
+    float h[MAX_DEVS];
+    float s[MAX_DEVS];
+    float v[MAX_DEVS];
+    uint8_t r[MAX_DEVS];
+    uint8_t g[MAX_DEVS];
+    uint8_t b[MAX_DEVS];
+    uint8_t dimming[MAX_DEVS];
+    int n;
+} color_buf;
+
 typedef struct device
 {
     char *ip;
     char *name;
     char *room;
+    char *mac; // optional; used to find the device again if its ip address changes
 } device;
 
+// A neighbor is an entry in the kernel's ipv4 neighbor (ARP) table.
+typedef struct neighbor
+{
+    struct in_addr addr;
+    uint8_t mac[6];
+} neighbor;
+
+/*
+  A dev_stats record holds the delivery history of a single device. Records are stored in a fixed-size, memory-mapped file of MAX_DEVS entries and are keyed by device name. When the file is full, the least recently used record is reused.
+ */
+typedef struct dev_stats
+{
+    char key[STATS_KEY];
+    uint32_t sent;   // packets sent to the device
+    uint32_t acked;  // replies received from the device
+    uint32_t srtt;   // smoothed round trip time in microseconds
+    uint32_t rttvar; // round trip time variation in microseconds
+    uint32_t used;   // time the record was last looked up, in seconds since the epoch
+} dev_stats;
+
+typedef enum trace_kind
+{
+    TRACE_TX_SW = 1,
+    TRACE_TX_HW,
+    TRACE_RX_SW,
+    TRACE_RX_HW,
+} trace_kind;
+
+/*
+  A trace file starts with a trace_hdr and is followed by fixed-size trace_rec records. Each record holds a kernel timestamp for a request sent to, or a reply received from, a device. Requests and replies are matched by address and id.
+ */
+struct trace_hdr
+{
+    uint32_t magic;
+    uint32_t version;
+};
+
+struct trace_rec
+{
+    uint8_t kind;  // a trace_kind
+    uint8_t pad[3];
+    uint32_t addr; // ipv4 address of the device, in network byte order
+    int32_t id;    // request id
+    uint32_t pad2;
+    int64_t ns;    // nanoseconds since the epoch (software) or on the NIC clock (hardware)
+};
+
+typedef enum capture_dir
+{
+    CAPTURE_TX = 1,
+    CAPTURE_RX,
+} capture_dir;
+
+/*
+  A capture file starts with a capture_hdr and is followed by variable-length records. Each record is a capture_rec followed by the len bytes of the packet's payload.
+ */
+struct capture_hdr
+{
+    uint32_t magic;
+    uint32_t version;
+};
+
+struct capture_rec
+{
+    int64_t ns;    // nanoseconds since the epoch
+    uint32_t addr; // ipv4 address the packet was sent to or received from, in network byte order
+    uint16_t port; // port, in network byte order
+    uint8_t dir;   // a capture_dir
+    uint8_t pad;
+    uint32_t len;  // length of the payload that follows
+    uint32_t pad2;
+};
+
+typedef enum phase
+{
+    PHASE_LOAD,
+    PHASE_PARSE,
+    PHASE_ENCODE,
+    PHASE_SEND,
+    PHASE_DISCOVER,
+    MAX_PHASE,
+} phase;
+
+/*
+  run_stats holds the phase timings and I/O counters reported by --stats. Times are in microseconds.
+ */
+struct run_stats
+{
+    bool enabled;
+    bool json;
+    int64_t start;
+    int64_t phase_us[MAX_PHASE];
+    int syscalls;
+    int tx_packets;
+    int rx_packets;
+    long tx_bytes;
+    long rx_bytes;
+};
+
+/*
+  A dev_table holds every device in the config file. The devices' strings point into buf, which holds the contents of the file.
+ */
+typedef struct dev_table
+{
+    char *buf;
+    device devs[MAX_DEVS];
+    int n;
+} dev_table;
+
 struct arg_vals
 {
+    bool adaptive;
     bool broadcast;
     bool change_col;
     bool turn_off;
     bool turn_on;
     bool discover;
     bool list;
+    bool read_stdin;
+    bool stats;
+    bool stats_json;
     char *name;
     char *room;
     char *ips;
+    char *trace;
+    char *capture;
     color col;
+    bool gradient;
+    color grad_from;
+    color grad_to;
+    const char *col_json; // pre-rendered json for a named color, or NULL
     int speed;
     int dimming;
     int kelvin;
@@ -96,17 +243,101 @@ struct arg_vals
     scene scene;
 };
 
+// name_hash is a case-insensitive FNV-1a hash of s, perturbed by seed. mktables uses it to build the perfect hash tables in tables.h, and wiz uses it to look names up in them.
+static inline uint32_t name_hash(uint32_t seed, const char *s)
+{
+    uint32_t h = 2166136261u ^ (seed * 16777619u);
+    for (; *s; s++)
+    {
+        h ^= (uint8_t)tolower((unsigned char)*s);
+        h *= 16777619u;
+    }
+    return h ^ (h >> 15);
+}
+
+// check_args reports combinations of options that cannot be used together. It returns 0 if args is valid or -1 if it is not.
+int check_args(struct arg_vals args);
+
+// run_configless carries out a command in discovery, broadcast, or ip mode, none of which use the config file.
+int run_configless(struct arg_vals args);
+
+// read_config returns the contents of the config file at path, with a trailing null byte, and writes its size to size. If create is true and the file does not exist, an empty one is created for the user to fill in. It returns NULL on failure, including when the file is empty. The caller must free the returned buffer.
+char *read_config(char *path, long *size, bool create);
+
+// send_to_devs encodes the command described by args and sends it to the n devices in devs. It returns EXIT_SUCCESS or EXIT_FAILURE.
+int send_to_devs(struct arg_vals args, device devs[], int n, char *wiz_path);
+
+// serve_stdin reads commands from stdin, one per line, until end of file. Each line is parsed as command line options and sent to the devices in the config file at wiz_path, which is reloaded whenever it changes.
+int serve_stdin(char *wiz_path);
+
+// load_table reads and parses the config file at path. It returns NULL on failure.
+dev_table *load_table(char *path);
+
+// free_table frees a table returned by load_table.
+void free_table(dev_table *tbl);
+
+// diff_tables prints the devices that were added to, removed from, or changed between old and new, and returns the number of differences.
+int diff_tables(dev_table *old, dev_table *new);
+
+// select_devs copies the devices in tbl that match names and rooms (either of which may be NULL to match everything) to devs and returns their number.
+int select_devs(dev_table *tbl, char *names, char *rooms, device devs[]);
+
 // send_cmds opens a UDP socket and writes n cmds to it.
 int send_cmds(char *msg, int mlen, device devs[], int num_devs);
 
+// send_cmds_each opens a UDP socket and writes msgs[i], of length mlens[i], to devs[i].
+int send_cmds_each(char msgs[][MAX_REQ], int mlens[], device devs[], int num_devs);
+
+// gradient_msgs writes one request per device to msgs, setting the devices' colors to a gradient between args.grad_from and args.grad_to. It returns 0 on success or -1 on failure.
+int gradient_msgs(char msgs[][MAX_REQ], int mlens[], struct arg_vals args, int num_devs);
+
+// rgb_to_hsv converts c to hue, saturation, and value, each in [0, 1).
+void rgb_to_hsv(color c, float *h, float *s, float *v);
+
+// gradient_hsv fills the h, s, and v channels of buf with n colors evenly spaced between from and to. Hue is interpolated the short way around the color wheel.
+void gradient_hsv(color_buf *buf, color from, color to, int n);
+
+// hsv_to_rgb fills the r, g, b, and dimming channels of buf from its h, s, and v channels. The rgb values are at full brightness and the value channel becomes the dimming level.
+void hsv_to_rgb(color_buf *buf);
+
+// send_cmds_adaptive writes msg to each device and waits for replies, resending to devices that have not replied. The number of attempts and the reply timeout for each device are derived from its record in stats, which is updated with the outcome. If missed is not NULL, missed[i] is set to whether devs[i] never replied. It returns -1 on failure or the number of devices that never replied.
+int send_cmds_adaptive(char *msg, int mlen, device devs[], int num_devs, dev_stats *stats, bool missed[]);
+
+// retry_resolved looks up the new ip addresses of the missed devices that have a mac address, resends msg to the devices it finds, and writes the new addresses of the devices that reply there to the config file at wiz_path. It returns -1 on failure or the number of missed devices that still did not reply.
+int retry_resolved(char *msg, int mlen, device devs[], int n, bool missed[], dev_stats *stats, char *wiz_path);
+
+// resolve_macs finds the current ip address of each missed device with a mac address, first in the kernel's neighbor table and then by asking every host on the device's last known /24 subnet for its device info. found[i] is set to the new address of devs[i], or to 0 if it was not found. It returns the number of devices found.
+int resolve_macs(device devs[], int n, bool missed[], struct in_addr found[]);
+
+// read_neighbors reads up to max entries of the kernel's ipv4 neighbor table via netlink. It returns the number of entries read, or -1 on failure.
+int read_neighbors(neighbor nbs[], int max);
+
+// sweep_macs sends getDevInfo to every host on subnet's /24 and waits up to SWEEP_TIMEOUT for the n devices with the given mac addresses to reply. found[i] is set to the address that macs[i] replied from. It returns the number of devices found, or -1 on failure.
+int sweep_macs(struct in_addr subnet, uint8_t macs[][6], struct in_addr found[], int n);
+
+// parse_mac parses a mac address written as 12 hex digits, optionally separated by colons or dashes. It returns 0 on success or -1 on failure.
+int parse_mac(const char *s, uint8_t mac[6]);
+
+// write_config_ips replaces the ip address of each device in devs that has a nonzero found address in the config file at path. The file is replaced atomically, so path should have its symlinks resolved.
+int write_config_ips(char *path, device devs[], struct in_addr found[], int n);
+
+// open_stats maps the delivery stats file at path into memory, creating it if necessary. It returns NULL on failure.
+dev_stats *open_stats(char *path);
+
+// close_stats unmaps a stats table returned by open_stats.
+int close_stats(dev_stats *stats);
+
 // parse_csv interprets data as the contents of a csv file. It writes the information to devs, which should have a length of MAX_DEVS. If search and/or search_room are not NULL, parse_csv ignores all devices with names or room names that do not mach these strings. (Each string argument is interpreted either as a single name or as a comma-separated list of names.) parse_csv returns the number of devices loaded into devs, or -1 on failure.
 int parse_csv(char *data, int n, device devs[], char *search, char *search_room);
 
 // init_color parses the string argument as either a named color or a comma-separated list of r, g, and b values of a color. It updates the color and returns 0 on success or -1 on failure.
 int init_color(color *col, char *s);
 
-// scene_str returns the scene id that matches s.
-scene str_scene(char *s);
+// color_index returns the position of the named color s in the generated color tables, ignoring case, or -1 if s is not a named color.
+int color_index(const char *s);
+
+// scene_str returns the scene id that matches s, ignoring case. s is not modified.
+scene str_scene(const char *s);
 
 // is_in interprets list as either a single string or a comma-separated list of strings. It returns true if s is equal to any of those strings.
 bool is_in(char *s, char *list);
@@ -0,0 +1,312 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "wiz.h"
+
+// wizreplay re-sends the requests in a capture file written by wiz --capture, or stands in for the captured devices by answering requests with the captured replies.
+
+// replies are sent with the id of the request they answer, so wiz -a can match them and measure round trip times
+#define DEFAULT_REPLY "{\"method\":\"setPilot\",\"env\":\"pro\",\"result\":{\"success\":true}}"
+
+const char usage[] =
+    "usage: wizreplay [-s SPEED] [-d ADDR[:PORT]] FILE\n"
+    "       wizreplay -r [-d ADDR[:PORT]] FILE\n"
+    "\n"
+    "  -s SPEED  replay at SPEED times the captured rate, or as fast as possible if SPEED is max (default 1)\n"
+    "  -d ADDR   send to, or with -r listen on, ADDR[:PORT] (default 127.0.0.1:38899)\n"
+    "  -r        answer each request with the next captured reply\n";
+
+typedef struct pkt
+{
+    struct capture_rec rec;
+    char *data;
+} pkt;
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// load_capture reads the packets in the capture file at path. Each packet's data is followed by a null byte. It returns the number of packets, or -1 on failure.
+static int load_capture(char *path, pkt **pkts)
+{
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+    struct capture_hdr hdr;
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || hdr.magic != CAPTURE_MAGIC || hdr.version != CAPTURE_VERSION)
+    {
+        fprintf(stderr, "%s is not a wiz capture file\n", path);
+        fclose(fp);
+        return -1;
+    }
+
+    int n = 0, cap = 0;
+    *pkts = NULL;
+    struct capture_rec rec;
+    while (fread(&rec, sizeof(rec), 1, fp) == 1)
+    {
+        if (n == cap)
+        {
+            int next_cap = (cap == 0) ? 64 : cap * 2;
+            pkt *next = realloc(*pkts, next_cap * sizeof(pkt));
+            if (next == NULL)
+            {
+                perror(NULL);
+                break;
+            }
+            *pkts = next;
+            cap = next_cap;
+        }
+        // len comes from the file, so bound it before it sizes an allocation
+        if (rec.len > CAPTURE_MAX_LEN)
+        {
+            fprintf(stderr, "%s is corrupt\n", path);
+            break;
+        }
+        char *data = malloc(rec.len + 1);
+        if (data == NULL)
+        {
+            perror(NULL);
+            break;
+        }
+        if (rec.len > 0 && fread(data, rec.len, 1, fp) != 1)
+        {
+            fprintf(stderr, "%s is truncated\n", path);
+            free(data);
+            break;
+        }
+        data[rec.len] = '\0';
+        (*pkts)[n].rec = rec;
+        (*pkts)[n].data = data;
+        n++;
+    }
+    fclose(fp);
+    return n;
+}
+
+// parse_addr parses ADDR[:PORT] into sin.
+static int parse_addr(char *s, struct sockaddr_in *sin)
+{
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(PORT);
+    char *colon = strchr(s, ':');
+    if (colon != NULL)
+    {
+        *colon = '\0';
+        sin->sin_port = htons(atoi(colon + 1));
+    }
+    return (inet_aton(s, &sin->sin_addr) == 0) ? -1 : 0;
+}
+
+// replay sends the captured requests to dst, spacing them out by their captured gaps divided by speed. A speed of 0 sends them back to back.
+static int replay(int sockfd, pkt pkts[], int n, struct sockaddr_in *dst, double speed)
+{
+    int sent = 0, replies = 0;
+    long bytes = 0;
+    int64_t first = -1;
+    int64_t start = now_ns();
+    char buf[1024];
+
+    for (int i = 0; i < n; i++)
+    {
+        if (pkts[i].rec.dir != CAPTURE_TX)
+            continue;
+        if (first < 0)
+            first = pkts[i].rec.ns;
+
+        if (speed > 0)
+        {
+            int64_t at = start + (int64_t)((pkts[i].rec.ns - first) / speed);
+            struct timespec ts = {at / 1000000000, at % 1000000000};
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+                ;
+        }
+        if (sendto(sockfd, pkts[i].data, pkts[i].rec.len, 0, (struct sockaddr *)dst, sizeof(*dst)) < 0)
+        {
+            perror(NULL);
+            return -1;
+        }
+        sent++;
+        bytes += pkts[i].rec.len;
+
+        while (recv(sockfd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+            replies++;
+    }
+    int64_t elapsed = now_ns() - start;
+
+    // give the responder a moment to answer the last requests
+    struct timeval tv = {0, 500000};
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    while (replies < sent && recv(sockfd, buf, sizeof(buf), 0) > 0)
+        replies++;
+
+    double secs = elapsed / 1e9;
+    printf("sent\t%d\nbytes\t%ld\nreplies\t%d\nelapsed (ms)\t%.3f\nrate (pkt/s)\t%.0f\n",
+           sent, bytes, replies, secs * 1000, (secs > 0) ? sent / secs : 0);
+    return 0;
+}
+
+// request_id finds the id of a request. It returns false if the request has none.
+static bool request_id(char *req, long *id)
+{
+    char *p = strstr(req, "\"id\"");
+    if (p == NULL)
+        return false;
+    for (p += 4; *p == ' ' || *p == ':'; p++)
+        ;
+    char *end;
+    *id = strtol(p, &end, 10);
+    return end != p;
+}
+
+// with_id writes reply to out with its id set to id, adding an id field if the reply has none. It returns the length of out.
+static int with_id(char *out, int size, char *reply, long id)
+{
+    int len;
+    char *p = strstr(reply, "\"id\"");
+    if (p != NULL)
+    {
+        char *v = p + 4;
+        while (*v == ' ' || *v == ':')
+            v++;
+        char *end = v + (*v == '-');
+        while (*end >= '0' && *end <= '9')
+            end++;
+        len = snprintf(out, size, "%.*s%ld%s", (int)(v - reply), reply, id, end);
+    }
+    else if (reply[0] == '{')
+        len = snprintf(out, size, "{\"id\":%ld,%s", id, reply + 1);
+    else
+        len = snprintf(out, size, "%s", reply);
+    return (len < size) ? len : size - 1;
+}
+
+// respond answers every request received on sockfd with the next captured reply, in order, or with a generic success reply if the capture has none. The reply carries the request's id. It runs until it is killed.
+static int respond(int sockfd, pkt pkts[], int n)
+{
+    int next = 0;
+    char buf[1024 + 1];
+    char out[2048];
+    for (;;)
+    {
+        struct sockaddr_in from;
+        socklen_t fromlen = sizeof(from);
+        ssize_t got = recvfrom(sockfd, buf, sizeof(buf) - 1, 0, (struct sockaddr *)&from, &fromlen);
+        if (got < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror(NULL);
+            return -1;
+        }
+        buf[got] = '\0';
+
+        char *reply = DEFAULT_REPLY;
+        int len = sizeof(DEFAULT_REPLY) - 1;
+        for (int i = 0; i < n; i++)
+        {
+            pkt *p = &pkts[(next + i) % n];
+            if (p->rec.dir == CAPTURE_RX)
+            {
+                reply = p->data;
+                len = p->rec.len;
+                next = (next + i + 1) % n;
+                break;
+            }
+        }
+        long id;
+        if (request_id(buf, &id))
+        {
+            len = with_id(out, sizeof(out), reply, id);
+            reply = out;
+        }
+        sendto(sockfd, reply, len, 0, (struct sockaddr *)&from, fromlen);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    double speed = 1;
+    bool responder = false;
+    struct sockaddr_in addr;
+    parse_addr("127.0.0.1", &addr);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:d:r")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            speed = (strcmp(optarg, "max") == 0) ? 0 : atof(optarg);
+            if (speed < 0)
+                speed = 1;
+            break;
+        case 'd':
+            if (parse_addr(optarg, &addr) < 0)
+            {
+                fprintf(stderr, "unable to parse address\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'r':
+            responder = true;
+            break;
+        default:
+            fprintf(stderr, "%s", usage);
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind != argc - 1)
+    {
+        fprintf(stderr, "%s", usage);
+        return EXIT_FAILURE;
+    }
+
+    pkt *pkts;
+    int n = load_capture(argv[optind], &pkts);
+    if (n < 0)
+        return EXIT_FAILURE;
+
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0)
+    {
+        perror(NULL);
+        return EXIT_FAILURE;
+    }
+
+    int res;
+    if (responder)
+    {
+        int reuse = 1;
+        setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        {
+            perror(NULL);
+            close(sockfd);
+            return EXIT_FAILURE;
+        }
+        res = respond(sockfd, pkts, n);
+    }
+    else
+        res = replay(sockfd, pkts, n, &addr, speed);
+
+    close(sockfd);
+    for (int i = 0; i < n; i++)
+        free(pkts[i].data);
+    free(pkts);
+    return (res < 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
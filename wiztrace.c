@@ -0,0 +1,155 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wiz.h"
+
+// wiztrace summarizes a trace file written by wiz --trace into per-device latency distributions.
+
+// A trace file holds a single command. Each device is sent at most MAX_TRIES attempts, and each attempt and its reply get a software and a hardware timestamp. Devices found at a new address are sent a second round of attempts, which doubles the bound.
+#define MAX_PASSES 2
+#define MAX_SAMPLES (MAX_TRIES * MAX_PASSES)
+#define MAX_RECS (MAX_DEVS * MAX_SAMPLES * 4)
+
+typedef struct dev_latency
+{
+    uint32_t addr;
+    int sent;
+    int replied;
+    int n;
+    int64_t ns[MAX_SAMPLES];
+} dev_latency;
+
+static int cmp_ns(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static int cmp_rec(const void *a, const void *b)
+{
+    return cmp_ns(&((const struct trace_rec *)a)->ns, &((const struct trace_rec *)b)->ns);
+}
+
+static dev_latency *find_dev(dev_latency devs[], int *num_devs, uint32_t addr)
+{
+    for (int i = 0; i < *num_devs; i++)
+    {
+        if (devs[i].addr == addr)
+            return &devs[i];
+    }
+    if (*num_devs == MAX_DEVS)
+        return NULL;
+    dev_latency *d = &devs[(*num_devs)++];
+    memset(d, 0, sizeof(*d));
+    d->addr = addr;
+    return d;
+}
+
+// tx_for returns the index of the latest transmit record of the given kind that precedes rx and has the same address and id, or -1. recs must be sorted by timestamp.
+static int tx_for(struct trace_rec recs[], int rx, uint8_t kind)
+{
+    for (int i = rx - 1; i >= 0; i--)
+    {
+        if (recs[i].kind == kind && recs[i].addr == recs[rx].addr && recs[i].id == recs[rx].id)
+            return i;
+    }
+    return -1;
+}
+
+// print_latencies prints one row of the summary table for d, using its software or hardware latencies.
+static void print_latencies(dev_latency *d, const char *clock)
+{
+    char ip[INET_ADDRSTRLEN] = "";
+    inet_ntop(AF_INET, &d->addr, ip, sizeof(ip));
+    printf("%s\t%s\t%d\t%d", ip, clock, d->sent, d->replied);
+    if (d->n == 0)
+    {
+        printf("\t-\t-\t-\t-\t-\n");
+        return;
+    }
+    qsort(d->ns, d->n, sizeof(int64_t), cmp_ns);
+    printf("\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\n",
+           d->ns[0] / 1000.0,
+           d->ns[d->n / 2] / 1000.0,
+           d->ns[d->n * 9 / 10] / 1000.0,
+           d->ns[d->n * 99 / 100] / 1000.0,
+           d->ns[d->n - 1] / 1000.0);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2)
+    {
+        fprintf(stderr, "usage: wiztrace FILE\n");
+        return EXIT_FAILURE;
+    }
+
+    FILE *fp = fopen(argv[1], "r");
+    if (fp == NULL)
+    {
+        perror(argv[1]);
+        return EXIT_FAILURE;
+    }
+    struct trace_hdr hdr;
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || hdr.magic != TRACE_MAGIC || hdr.version != TRACE_VERSION)
+    {
+        fprintf(stderr, "%s is not a wiz trace file\n", argv[1]);
+        fclose(fp);
+        return EXIT_FAILURE;
+    }
+
+    struct trace_rec *recs = malloc(sizeof(struct trace_rec) * MAX_RECS);
+    static dev_latency sw[MAX_DEVS], hw[MAX_DEVS];
+    int num_sw = 0, num_hw = 0;
+    if (recs == NULL)
+    {
+        perror(NULL);
+        fclose(fp);
+        return EXIT_FAILURE;
+    }
+    int n = fread(recs, sizeof(struct trace_rec), MAX_RECS, fp);
+    if (n == MAX_RECS && fgetc(fp) != EOF)
+        fprintf(stderr, "%s has more than %d records; the rest are ignored\n", argv[1], MAX_RECS);
+    fclose(fp);
+
+    // transmit timestamps can be written after the replies they belong to, so pair records in timestamp order rather than file order
+    qsort(recs, n, sizeof(struct trace_rec), cmp_rec);
+
+    for (int i = 0; i < n; i++)
+    {
+        bool is_sw = (recs[i].kind == TRACE_TX_SW || recs[i].kind == TRACE_RX_SW);
+        dev_latency *d = is_sw ? find_dev(sw, &num_sw, recs[i].addr) : find_dev(hw, &num_hw, recs[i].addr);
+        if (d == NULL)
+            continue;
+
+        switch (recs[i].kind)
+        {
+        case TRACE_TX_SW:
+        case TRACE_TX_HW:
+            d->sent++;
+            break;
+        case TRACE_RX_SW:
+        case TRACE_RX_HW:
+        {
+            d->replied++;
+            int tx = tx_for(recs, i, (recs[i].kind == TRACE_RX_SW) ? TRACE_TX_SW : TRACE_TX_HW);
+            if (tx >= 0 && d->n < MAX_SAMPLES)
+                d->ns[d->n++] = recs[i].ns - recs[tx].ns;
+            break;
+        }
+        }
+    }
+
+    printf("DEVICE\tCLOCK\tSENT\tREPLIED\tMIN\tP50\tP90\tP99\tMAX (us)\n");
+    for (int i = 0; i < num_sw; i++)
+        print_latencies(&sw[i], "sw");
+    for (int i = 0; i < num_hw; i++)
+        print_latencies(&hw[i], "hw");
+
+    free(recs);
+    return EXIT_SUCCESS;
+}